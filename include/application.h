@@ -15,6 +15,11 @@ struct App_Data
   unsigned frame_count = 0;
   float cma_fdt = 0.0f; // cumulative-moving-average of frame-delta-time
   bool running = true;
+  bool visible = true; // false while minimized or hidden
+  bool headless = false; // --headless: an EGL context without a window, updates run unpaced until the app stops
+  int gl_major = 4, gl_minor = 6; // the context init creates, on_configure may ask for less
+  bool gl = true; // headless only, on_configure may do without a context
+  int exit_code = 0; // what main returns, non-zero once the context or an output failed
 };
 
 
@@ -30,17 +35,27 @@ class Application
 {
   void init_SDL(const char *, int, int, int, int, int);
   void init_OGL();
+  void init_EGL();
+  void load_OGL(GLADloadproc);
+  void *egl_display = nullptr, *egl_context = nullptr;
+  bool initialized = false; // on_init ran, on_exit has something to release
+  void handle_event(SDL_Event);
 public:
   void init(int, char**, int, int);
   bool is_running();
   void step();
-  void exit();
+  int exit();
 protected:
   App_Data app_data;
   SDL_App_Data sdl_app_data;
 
+  const char * option(const char *);
+  bool flag(const char *);
+
+  virtual void on_configure();
   virtual void on_init();
   virtual void on_event(SDL_Event);
+  virtual bool needs_update();
   virtual void on_update();
   virtual void on_exit();
 };
@@ -74,10 +89,15 @@ std::string GLenum_string(GLenum e);
 
 extern void GLAPIENTRY callback(GLenum, GLenum, GLuint, GLenum, GLsizei, const GLchar *, const void *);
 
+// GL_KHR_parallel_shader_compile, not part of the loaded core profile
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (GLAPIENTRY *PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint);
+
 
 #include <set>
 #include <vector>
 #include <unordered_map>
+#define PROGRAM_CACHE_DIR "cache" // linked program binaries and the benchmarked compute tile
 class Shader
 {
   std::string file_path;
@@ -85,8 +105,17 @@ class Shader
   std::vector<GLuint> shaderHandles;
   std::unordered_map<const char *, int> uniform_location_map;
   std::set<const char *> nonexistent_uniform_set;
+  std::vector<std::pair<std::string, std::string>> defines;
+  std::string generated; // replaces the source's "#pragma scene" line
+  std::vector<std::string> sources; // per stage, as handed to glShaderSource
+  std::string binary_file;
+  bool from_binary = false;
+  bool linking = false; // link() returned without waiting, finish() is still due
   void log_resource(GLenum);
   const char * stages();
+  std::string binary_path();
+  bool load_binary();
+  void store_binary();
 public:
   GLuint handle;
 
@@ -98,11 +127,18 @@ public:
       shaderHandles.push_back(glCreateShader(shaderT));
     }
   }
+  void define(const char *, std::string);
+  void generate(std::string);
+  std::string key(const char *);
+  void adopt(GLuint);
   void source(const char *, bool = false);
+  static bool parallel_compile; // GL_KHR_parallel_shader_compile, ready() can poll
   void compile();
-  void link();
+  void link(bool = true);
+  bool ready();
+  bool finish();
   void log_program_resources();
-  int loc(const char *);
+  int loc(const char *, bool = false);
 };
 
 
@@ -111,4 +147,4 @@ void log(const int shader_id, GLenum requested_property);
 
 
 
-void parseOBJ(const char*);
\ No newline at end of file
+bool parseOBJ(const char*, std::vector<glm::vec3>&, std::vector<glm::uvec3>&);
\ No newline at end of file
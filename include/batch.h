@@ -0,0 +1,19 @@
+#pragma once
+#include "application.h"
+#include <string>
+#include <vector>
+
+
+// One line of a --batch manifest: a scene file and the png it renders to, then any of
+//   eye=x,y,z  target=x,y,z  fov=degrees  samples=n
+// The fields left out keep the values from the command line. Blank lines and # comments are skipped.
+struct Batch_Job
+{
+  std::string scene, output;
+  glm::vec3 eye, target;
+  float fov;
+  unsigned samples;
+};
+
+
+std::vector<Batch_Job> read_manifest(const char *, const Batch_Job &);
@@ -0,0 +1,29 @@
+#pragma once
+#include <vector>
+#include <glm.hpp>
+
+
+struct AABB
+{
+  glm::vec3 lo = glm::vec3(+1e30f);
+  glm::vec3 hi = glm::vec3(-1e30f);
+
+  void grow(glm::vec3);
+  void grow(const AABB&);
+  glm::vec3 centroid() const;
+  float area() const;
+};
+
+
+// Matches the std430 layout of BVHNode in ray-compute.glsl (vec3 + int pack into one vec4).
+// Nodes are stored depth-first: an internal node's left child is the next node and offset
+// holds the right child, a leaf's offset is the first entry of its primitive range.
+struct BVH_Node
+{
+  glm::vec3 lo; int offset;
+  glm::vec3 hi; int count; // 0 for internal nodes
+};
+
+
+// Binned SAH build over the given bounds. order receives the primitive indices in leaf order.
+void build_BVH(const std::vector<AABB>&, std::vector<BVH_Node>&, std::vector<int>&);
@@ -0,0 +1,44 @@
+#pragma once
+#include "application.h"
+#include "workers.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+
+#define CAPTURE_SLOTS 3 // frames between the copy out of the texture and the writer
+
+
+// Streams frames of an RGBA texture to a file or a named pipe, as Y4M (4:4:4, BT.601) when the path
+// ends in .y4m and as raw rgb24 otherwise. Each frame is copied into a ring of persistently mapped
+// pixel buffers and written by a thread of its own. A full ring drops the frame, or with block set
+// waits for the consumer instead.
+class Frame_Stream
+{
+  struct Slot
+  {
+    GLuint pbo = 0;
+    const GLubyte *pixels = nullptr;
+    GLsync fence = 0;                              // copy in flight
+    std::shared_ptr<std::atomic<bool>> written;    // handed to the writer, set once it's out
+  };
+  Slot slot[CAPTURE_SLOTS];
+  unsigned next = 0; // slot of the next copy, and the oldest one in flight
+  std::FILE *out = nullptr;
+  std::string path;
+  bool y4m = false, block = false;
+  int width = 0, height = 0;
+  Worker_Pool writer;
+  std::shared_ptr<std::atomic<bool>> failed;
+  bool busy(const Slot&) const;
+  bool submit(Slot&);
+public:
+  std::size_t frames = 0, dropped = 0;
+  bool open(const std::string&, int, int, int, bool);
+  bool is_open() const { return out != nullptr; }
+  bool in_flight() const;
+  void capture(GLuint, int, int);
+  void poll();
+  void close();
+};
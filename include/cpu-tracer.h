@@ -0,0 +1,69 @@
+#pragma once
+#include "ray-tracer-app.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+#define CPU_TILE 16 // side of the square tiles the cpu integrator hands its threads
+
+
+// One deque of tiles per thread. A thread works through its own from the front and, once it runs
+// dry, steals from the back of the others, so a thread stuck on an expensive tile doesn't hold up
+// the frame. dispatch deals the tiles out in contiguous runs and returns when all of them are done.
+class Tile_Scheduler
+{
+  struct Queue
+  {
+    std::mutex lock;
+    std::deque<unsigned> tiles;
+  };
+  std::vector<std::thread> threads;
+  std::unique_ptr<Queue[]> queues;
+  std::function<void(unsigned)> job;
+  std::mutex lock;
+  std::condition_variable wake, done;
+  unsigned generation = 0, busy = 0;
+  bool stopping = false;
+  bool next_tile(unsigned, unsigned&);
+  void run(unsigned);
+public:
+  void start(unsigned);
+  void dispatch(const std::vector<unsigned>&, std::function<void(unsigned)>);
+  void stop();
+};
+
+
+// What a frame of the cpu integrator traces, the uniforms of the megakernel
+struct CPU_Frame
+{
+  const Scene_Interpreter *scene;
+  glm::vec3 eye, across, corner, up;
+  glm::ivec2 resolution;
+  int max_depth;
+  bool accumulate;
+  unsigned index, seed; // frameIndex and frameSeed
+};
+
+
+// The megakernel of ray-compute.glsl in C++, traced from the same Scene_Interpreter buffers and with
+// the same sampler, on a Tile_Scheduler with the tiles in Morton order. image is what the frame
+// leaves in render_tex. Reprojection and adaptive sampling stay with the gpu integrators.
+class CPU_Tracer
+{
+  Tile_Scheduler scheduler;
+  std::vector<unsigned> order; // tiles in Morton order
+  std::vector<uint32_t> sobol, pcg_state;
+  std::vector<glm::vec4> accum; // { running-mean rgb, sample count }
+  glm::ivec2 size = glm::ivec2(0);
+public:
+  std::vector<glm::vec4> image;
+  void start(unsigned);
+  void trace(const CPU_Frame&);
+  void stop();
+};
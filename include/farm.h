@@ -0,0 +1,27 @@
+#pragma once
+#include "application.h"
+#include <atomic>
+
+
+#define FARM_TILE 64 // side of the square regions a --processes worker takes at a time
+
+
+// The frame a tile farm shares through POSIX shared memory: this header, then a completion flag
+// per tile holding the number of the worker that rendered it, then the RGBA32F pixels. Workers
+// take tiles off next_tile until it runs past tile_count, which balances the load by itself.
+struct Farm_Frame
+{
+  std::atomic<unsigned> next_tile;
+  unsigned tile_count, tiles_x;
+  int width, height;
+  std::atomic<unsigned> *done() { return reinterpret_cast<std::atomic<unsigned>*>(this + 1); }
+  GLfloat *pixels() { return reinterpret_cast<GLfloat*>(done() + tile_count); }
+};
+
+
+extern Farm_Frame *farm;     // the shared frame in a worker process, null otherwise
+extern unsigned farm_worker; // 1 based
+
+// With --headless --processes N, forks N workers, waits for them to fill the frame and saves it.
+// Returns the exit status in that coordinating process, and -1 in the workers and without --processes.
+int run_tile_farm(int, char**, int, int);
@@ -0,0 +1,51 @@
+#pragma once
+#include "application.h"
+#include <string>
+#include <vector>
+
+
+#define PROFILER_FRAMES 3    // query sets in flight, each is read back PROFILER_FRAMES-1 frames after use
+#define PROFILER_HISTORY 240 // samples per scope behind the rolling statistics
+
+
+struct Profiler_Stats
+{
+  float last_ms = 0.0f, min_ms = 0.0f, avg_ms = 0.0f, p99_ms = 0.0f;
+};
+
+
+// GPU time of named scopes from pairs of GL_TIMESTAMP queries, so scopes may nest. Every frame records
+// into its own query set, which is read only when it comes round again; by then the results are in and
+// reading them can't stall. A set whose results are still missing is dropped instead of waited for.
+// Several scopes of one name in a frame add up to one sample.
+class GPU_Profiler
+{
+  struct Record { int scope; GLuint begin, end; };
+  struct Query_Set
+  {
+    std::vector<GLuint> pool;
+    std::size_t used = 0;
+    std::vector<Record> records;
+  };
+  struct Scope
+  {
+    std::string name;
+    std::vector<float> history; // ring of the last PROFILER_HISTORY samples
+    std::size_t samples = 0;
+  };
+  Query_Set sets[PROFILER_FRAMES];
+  unsigned current = 0;
+  std::vector<Scope> scopes;
+  std::vector<Record> open;
+  GLuint next_query();
+  void collect(Query_Set&);
+public:
+  bool enabled = true; // without a GL context the scopes are ignored
+  void next_frame();
+  void begin(const char *);
+  void end();
+  std::size_t scope_count() const;
+  Profiler_Stats stats(std::size_t) const;
+  std::string report() const;
+  void release();
+};
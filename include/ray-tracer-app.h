@@ -1,5 +1,9 @@
 #pragma once
 #include "application.h"
+#include "bvh.h"
+#include "watcher.h"
+#include <atomic>
+#include <memory>
 
 
 typedef unsigned MenuID;
@@ -30,6 +34,7 @@ struct Menu_State
   std::vector<MenuID> c;
   std::optional<std::string> description;
   std::optional<std::function<void(MenuInputID)>> modulate;
+  std::optional<std::function<std::string()>> report; // builds the description when it's shown
 
   MenuID input(MenuInputID);
   Menu_State(std::string, MenuID, MenuID, std::vector<MenuID> &t);
@@ -59,16 +64,43 @@ struct Scene_Object_Variable
 struct Scene_Object
 {
   std::string name;
-  int subtype, material_index;
+  int subtype, material_index, mesh_index = -1;
   std::vector<Scene_Object_Variable*> variable;
 
   Scene_Object(std::smatch&);
 };
 
 
+// Matches LightRecord in ray-compute.glsl
+struct Light_Record
+{
+  glm::vec4 position;
+  glm::vec4 direction; // unit length
+  glm::vec4 color;
+  glm::vec4 params;    // { cos(angle/2), intensity, range, - }
+};
+
+
+struct Scene_Mesh
+{
+  std::string file;
+  int root;    // first node of the mesh's bvh in mesh_bvh
+  AABB bounds; // in object space
+};
+
+
+// What ray-compute.glsl gets baked in for a scene, see Scene_Interpreter::variant
+struct Scene_Variant
+{
+  std::vector<std::pair<std::string, std::string>> defines;
+  std::string code; // castRay, occluded and getLightSample unrolled over the scene, empty for larger scenes
+};
+
+
 class Scene_Interpreter
 {
   void create_object(std::smatch&);
+  void create_mesh(std::smatch&);
   void create_variable(std::smatch&);
 public:
   std::vector<Scene_Object*> geometry;
@@ -78,10 +110,24 @@ public:
   std::vector<int> gbuf;
   std::vector<int> mbuf;
   std::vector<int> lbuf;
+  std::vector<BVH_Node> bvh; // over the bounded geometry, which leads gbuf in leaf order
+  int num_bounded = 0;
+  std::vector<Scene_Mesh> mesh;
+  std::vector<glm::vec4> mesh_vertices;
+  std::vector<glm::uvec4> mesh_faces;  // absolute vertex indices, leaf order of their mesh's bvh
+  std::vector<BVH_Node> mesh_bvh;      // absolute child and face offsets
+  std::vector<glm::vec4> sphere_table; // compiled from heap by regenerate_bufs, gbuf.y indexes them
+  std::vector<glm::vec4> plane_table;
+  std::vector<glm::vec4> mesh_table;
+  std::vector<Light_Record> light_table;
   Scene_Object *target = nullptr;
 
-  void translate_file(std::string);
+  bool translate_file(std::string);
+  bool complete() const;
+  bool load(std::string, std::string&);
   void regenerate_bufs();
+  void compile_lights();
+  Scene_Variant variant(bool);
 };
 
 
@@ -105,16 +151,125 @@ struct PinholeCamera
 };
 
 
+enum Dirty_Flag
+{
+  clean          = 0,
+  dirty_camera   = 1<<0,
+  dirty_scene    = 1<<1,
+  dirty_size     = 1<<2,
+  dirty_shader   = 1<<3,
+  dirty_settings = 1<<4,
+  dirty_present  = 1<<5, // re-present the last image without tracing
+  dirty_geometry = 1<<6  // the primitive tables were recompiled, the baked scene variant may be stale
+};
+
+
+#define STAGING_REGIONS 3 // frames whose heap edits may be in flight at once
+// Heap edits reach HEAP through this persistently mapped ring: the edits made between two frames are
+// coalesced into one dirty byte range, written to the next region once its fence has passed, flushed
+// once and copied into HEAP on the GPU. Each region holds a whole heap.
+struct Staging_Ring
+{
+  GLuint buffer = 0;
+  char *mapped = nullptr;
+  GLsizeiptr region_size = 0;
+  GLsync fence[STAGING_REGIONS] = {};
+  unsigned next = 0;
+  std::size_t dirty_lo = ~std::size_t(0), dirty_hi = 0; // bytes of the heap edited since the last flush
+};
+
+
+#define MAX_PENDING_CAPTURES 4
+
+// A save in flight: render_tex copied into a persistently mapped pixel buffer, read by a png worker
+// once the fence has passed
+struct Pending_Capture
+{
+  GLuint pbo = 0;
+  const GLfloat *pixels = nullptr;
+  GLsync fence = 0;
+  int width = 0, height = 0;
+  std::string file;
+  std::shared_ptr<std::atomic<bool>> encoded; // set by the worker, null until submitted
+};
+
+// Clamps RGBA32F pixels, rows top to bottom, to 8 bits and saves them as a png
+bool encode_png(const GLfloat*, int, int, const std::string&);
+
+
+// Steers render_scale to hold a GPU time budget per traced frame, see Ray_Tracer_App::adapt_resolution
+struct Resolution_Controller
+{
+  bool enabled = false;
+  float target_ms = 0.0f;
+  float gpu_ms = 0.0f;        // smoothed GL_TIME_ELAPSED of the trace dispatches, 0 until measured
+  GLuint query[2] = { 0, 0 }; // double buffered, last frame's result is read while this one runs
+  unsigned frame = 0;
+  int cooldown = 0;           // frames left before the next change may happen
+};
+
+
+enum Integrator
+{
+  megakernel, // one dispatch traces whole paths
+  wavefront,  // generate, extend, shade and connect passes joined by ray queues
+  cpu         // the megakernel ported to C++ on a pool of threads, see CPU_Tracer
+};
+
+
 class Ray_Tracer_App : public Application
 {
   PinholeCamera* cam;
+  PinholeCamera* traced_cam; // the camera of the last traced frame, reprojection's source view
   Scene_Interpreter scene;
   Terminal_Menu menu;
+  glm::ivec2 tile;
+  bool accumulate;
+  unsigned max_samples;
+  float error_threshold; // adaptive sampling stops tracing tiles under it, 0 disables
+  bool converged = false;
+  bool temporal;         // reproject accumulated samples across camera moves
+  Integrator integrator;
+  int wave_size;
+  float render_scale;    // render resolution relative to the window, see set_render_scale
+  glm::ivec2 resolution;
+  Resolution_Controller dynres;
+  File_Watcher watcher;  // --watch: hot reload of the shaders and the scene
+
+  void compile_kernel(Shader&, int);
+  void build_ray_shader();
+  void refresh_variant();
+  void build_wavefront();
+  void size_wavefront_queues();
+  void resize_render_targets();
+  void set_render_scale(float);
+  void adapt_resolution();
+  void size_active_tiles();
+  void find_active_tiles();
+  void poll_convergence();
+  void bind_history();
+  void orbit_camera(float, float, float);
+  bool finish_kernels();
+  void upload_uniforms();
+  void benchmark_tile_sizes();
+  void dispatch_wavefront();
+  void present();
+  void draw_profiler();
+  void reload_kernels();
+  void reload_render_shader();
+  bool reload_scene(std::size_t* = nullptr);
+  bool start_job(std::size_t);
+  void finish_job();
+  void render_farm_tile();
+  void trace_on_cpu();
+  void poll_captures();
 protected:
+  void on_configure() override;
   void on_init() override;
   void on_event(SDL_Event) override;
+  bool needs_update() override;
   void on_update() override;
   void on_exit() override;
 public:
-  void save_framebuffer_as_PNG();
+  void save_framebuffer_as_PNG(const std::string& = "");
 };
\ No newline at end of file
@@ -0,0 +1,19 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+
+// Sobol dimensions the shader draws from the direction-number texture; later dimensions
+// fall back to the per-pixel PCG stream (see Sampler in ray-compute.glsl).
+#define SOBOL_DIMS 16
+#define SOBOL_BITS 32
+
+
+// Direction numbers of the first SOBOL_DIMS Sobol dimensions (Joe & Kuo, new-joe-kuo-6.21201),
+// SOBOL_BITS per dimension, laid out row-major as a SOBOL_BITS x SOBOL_DIMS texture.
+std::vector<uint32_t> sobol_direction_numbers();
+
+// Initial PCG state of the pixel at the given row-major index, and of each of the given number of pixels.
+uint32_t pcg_seed(std::size_t);
+std::vector<uint32_t> pcg_seeds(std::size_t);
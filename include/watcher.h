@@ -0,0 +1,32 @@
+#pragma once
+#include "application.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+
+// Watches files for writes on a background thread (inotify, Linux only). Each batch of changes
+// pushes an SDL event of type File_Watcher::event, and changed() then hands over the paths.
+// The parent directories are watched, so editors that save by renaming a new file are seen too.
+class File_Watcher
+{
+  int fd = -1;
+  std::map<int, std::string> directories; // inotify watch descriptor -> directory
+  std::set<std::string> files;
+  std::set<std::string> pending;
+  std::mutex lock; // guards the containers above, run() reads them while watch() may add to them
+  std::atomic<bool> running{false};
+  std::thread worker;
+  void run();
+public:
+  static Uint32 event;
+
+  bool start();
+  void watch(const std::string&);
+  std::vector<std::string> changed();
+  void stop();
+};
@@ -0,0 +1,26 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// A fixed set of threads running jobs from a bounded queue. try_submit never blocks: when the queue
+// is full it refuses the job and the caller decides whether to retry later.
+class Worker_Pool
+{
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()>> jobs;
+  std::size_t capacity = 0;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stopping = false;
+  void run();
+public:
+  void start(unsigned, std::size_t);
+  bool try_submit(std::function<void()>);
+  void stop(); // finishes the queued jobs, then joins
+};
@@ -1,18 +1,108 @@
 #shader compute
 #version 460
 
-layout (local_size_x = 1, local_size_y = 1) in;
+#ifndef TILE_W
+#define TILE_W 8
+#endif
+#ifndef TILE_H
+#define TILE_H 8
+#endif
+#ifndef MAX_DEPTH
+#define MAX_DEPTH 5
+#endif
+#ifndef SOBOL_DIMS
+#define SOBOL_DIMS 16
+#endif
+
+// Scene variant, see Scene_Interpreter::variant: bitmasks of the shape, material and light subtypes
+// the scene uses. The defaults keep every subtype; NUM_SHAPES, NUM_BOUNDED and NUM_LIGHTS replace
+// the count uniforms, and SCENE_UNROLLED swaps the loops below for code generated per object.
+#ifndef SCENE_SHAPES
+#define SCENE_SHAPES 0x7
+#endif
+#ifndef SCENE_MATERIALS
+#define SCENE_MATERIALS 0xF
+#endif
+#ifndef SCENE_LIGHTS
+#define SCENE_LIGHTS 0x7
+#endif
+#ifndef SCENE_UNROLLED
+#define SCENE_UNROLLED 0
+#endif
+
+// STAGE selects the entry point: the single-pass megakernel or one pass of the wavefront pipeline
+#define STAGE_MEGAKERNEL 0
+#define STAGE_GENERATE   1
+#define STAGE_EXTEND     2
+#define STAGE_SHADE      3
+#define STAGE_CONNECT    4
+#define STAGE_RESOLVE    5
+#define STAGE_ARGS       6
+#define STAGE_CONVERGE   7
+#ifndef STAGE
+#define STAGE STAGE_MEGAKERNEL
+#endif
+#define WAVEFRONT_GROUP 64
+
+#if STAGE == STAGE_MEGAKERNEL || STAGE == STAGE_RESOLVE || STAGE == STAGE_CONVERGE
+layout (local_size_x = TILE_W, local_size_y = TILE_H) in;
+#elif STAGE == STAGE_ARGS
+layout (local_size_x = 1) in;
+#else
+layout (local_size_x = WAVEFRONT_GROUP) in;
+#endif
 
 layout (RGBA32F, binding = 0) uniform image2D render_image;
+layout (RGBA32F, binding = 1) uniform image2D accum_image; // { running-mean rgb, sample count }
+layout (R32F, binding = 2) uniform image2D moment_image;     // sum of squared luminance deviations (Welford)
+layout (RGBA32F, binding = 3) uniform image2D gbuffer_image;  // { primary hit normal, hit distance (0 on a miss) }
+layout (RGBA32F, binding = 4) uniform image2D prev_accum_image;   // accum_image and gbuffer_image as the
+layout (RGBA32F, binding = 5) uniform image2D prev_gbuffer_image; // previous camera left them, see reproject
 
 layout (std430, binding=0) buffer SceneData     { float heap[]; };
 layout (std430, binding=1) buffer GeometryIndex { ivec4 gbuf[]; };
 layout (std430, binding=2) buffer MaterialIndex { ivec2 mbuf[]; };
 layout (std430, binding=3) buffer LightIndex    { ivec2 lbuf[]; };
 
+// Per-type tables compiled from the heap by Scene_Interpreter::regenerate_bufs, gbuf.y indexes them
+struct LightRecord { vec4 position; vec4 direction; vec4 color; vec4 params; }; // direction normalized
+layout (std430, binding=15) buffer SphereTable { vec4 spheres[]; }; // { center, radius^2 }
+layout (std430, binding=16) buffer PlaneTable  { vec4 planes[]; };  // { unit normal, dot(normal, point) }
+layout (std430, binding=17) buffer MeshTable   { vec4 meshes[]; };  // { position, scale }
+layout (std430, binding=18) buffer LightTable  { LightRecord lights[]; }; // params: { cos(angle/2), intensity }
+
+// Sampler inputs: Sobol direction numbers (32 bits x SOBOL_DIMS) and each pixel's PCG state
+layout (binding = 1) uniform usampler2D sobolDirections;
+layout (std430, binding=14) buffer SamplerState { uint pcgState[]; };
+
+// { aabb-min, right-child or first-gbuf-index, aabb-max, gbuf-count (0 for internal nodes) }
+struct BVHNode { vec3 lo; int offset; vec3 hi; int count; };
+layout (std430, binding=4) buffer SceneBVH { BVHNode bvh[]; };
+
+// Triangle meshes of all $mesh objects: faces in leaf order of their mesh's bvh, offsets absolute
+layout (std430, binding=10) buffer MeshVertices { vec4 vertices[]; };
+layout (std430, binding=11) buffer MeshFaces    { uvec4 faces[]; };
+layout (std430, binding=12) buffer MeshBVH      { BVHNode meshBVH[]; };
+
+#if STAGE == STAGE_MEGAKERNEL || STAGE == STAGE_CONVERGE
+// Tiles of TILE_W x TILE_H pixels whose error is still above the threshold, args: { tile count, 1, 1, - }
+layout (std430, binding=13) buffer ActiveTiles { uvec4 activeTileArgs; uint activeTiles[]; };
+#else
+// Wavefront queues, each pass consumes one and appends compacted work to the next
+struct PathRay   { vec4 o; vec4 d; vec4 throughput; };    // o.w: pixel index, d.w: path flags
+struct PathHit   { vec4 position; vec4 normal; ivec4 i; }; // position.w: t, i: { ray-index, mbuf-index }
+struct ShadowRay { vec4 o; vec4 d; vec4 contribution; };  // o.w: distance to the light, d.w: pixel index
+layout (std430, binding=5) buffer RayQueue    { PathRay rays[]; }; // two halves of waveCapacity, ping-ponged per depth
+layout (std430, binding=6) buffer HitQueue    { PathHit hits[]; };
+layout (std430, binding=7) buffer ShadowQueue { ShadowRay shadows[]; };
+layout (std430, binding=8) buffer QueueState  { uint rayCount[2]; uint hitCount; uint shadowCount; uvec4 dispatchArgs; };
+layout (std430, binding=9) buffer Radiance    { uint radiance[]; }; // per-pixel rgb in 16.16 fixed point, summed with atomics
+#endif
+
 // Geometry SubTypes
-struct Plane  { ivec2 i; }; // { heap-index, mbuf-index }
+struct Plane  { ivec2 i; }; // { table-index, mbuf-index }
 struct Sphere { ivec2 i; };
+struct Mesh   { ivec3 i; }; // { table-index, mbuf-index, root node in meshBVH }
 
 // Material SubTypes
 struct Diffuse    { vec3 ka; vec3 kd; };
@@ -21,7 +111,7 @@ struct Reflective { vec3 kr; };
 struct Glass      { vec3 kr; vec3 kt; float ior; };
 
 // Light SubTypes
-struct Directional { int i; }; // { heap-index }
+struct Directional { int i; }; // { lights-index }
 struct Point       { int i; };
 struct Spot        { int i; };
 
@@ -33,14 +123,39 @@ struct Camera { vec3 eye; vec3 across; vec3 corner; vec3 up; };
 
 // uniforms and constants
 const float pi = 3.14159;
-const int maxDepth = 5;
+const int maxDepth = MAX_DEPTH;
 const float tmin = 0.05;
 const float tmax = 1e20;
+const int bvhStackSize = 32;
 uniform Camera cam;
+#ifdef NUM_SHAPES
+const int numShapes = NUM_SHAPES;
+const int numBounded = NUM_BOUNDED;
+const int numLights = NUM_LIGHTS;
+#else
 uniform int numShapes;
+uniform int numBounded; // gbuf[0, numBounded) is covered by the bvh, the rest (planes) is always tested
 uniform int numLights;
+#endif
+uniform ivec2 resolution; // size of render_image, independent of the window
+uniform bool accumulate = false;
+uniform uint frameIndex = 0u; // samples accumulated since the last reset
+uniform uint frameSeed = 0u;  // frames traced since start, less frameIndex it seeds the scramble of an accumulation
+uniform bool reproject = false; // the camera moved: history comes from prev_*_image, seen by prevCam
+uniform Camera prevCam;
+const float maxHistory = 16.0;  // reprojected history counts as at most this many samples
+uniform bool adaptive = false; // trace only the tiles listed in activeTiles
+uniform ivec2 regionOffset = ivec2(0);         // a tile farm worker's images hold one region of the frame,
+uniform ivec2 regionSize = ivec2(0x7FFFFFFF); // this is where it sits and how much of it is in the frame
+uniform float errorThreshold;  // relative standard error of the mean luminance a tile must get under
 uniform vec3 ambient = vec3(0.05, 0.05, 0.05);
 
+// constant false for subtypes the scene lacks and constant true when it has no other
+bool isMaterial(ivec2 m, int type)
+{
+  return (SCENE_MATERIALS & (1 << type)) != 0 && (SCENE_MATERIALS == (1 << type) || m.x == type);
+}
+
 // jenkins one-at-a-time hash
 uint hash(uint x) {
   x += (x << 10u);
@@ -51,17 +166,92 @@ uint hash(uint x) {
   return x;
 }
 uint hash(uvec3 v) { return hash(v.x ^ hash(v.y) ^ hash(v.z)); }
-float randomFloatBetween0and1(uint seed) { return uintBitsToFloat((seed&0x007FFFFFu)|0x3F800000u) - 1.0; }
-float random(uvec3 v) { return randomFloatBetween0and1(hash(v)); }
+
+// Sampler: sample `index` of a pixel draws dimension d from an Owen-scrambled Sobol sequence for
+// d < SOBOL_DIMS and from the pixel's PCG stream beyond. Dimensions are assigned by purpose (see
+// dimPixel, bounceDimension) so no two decisions of one path ever share a number.
+struct Sampler { uint index; uint seed; uint stream; };
+
+const uint dimPixel = 0u;      // 2D sub-pixel jitter
+const uint dimsPerBounce = 3u; // 2D hemisphere direction, 1D light choice
+uint bounceDimension(int bounce, uint k) { return 2u + uint(bounce) * dimsPerBounce + k; }
+
+uint pcg(uint state)
+{
+  uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+// Laine-Karras hash applied to reversed bits: a nested uniform (Owen) scramble (Burley 2020)
+uint owenScramble(uint x, uint seed)
+{
+  x = bitfieldReverse(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return bitfieldReverse(x);
+}
+
+uint sobol(uint index, uint dim)
+{
+  uint x = 0u;
+  for (int bit = 0; index != 0u; bit++, index >>= 1)
+    if ((index & 1u) != 0u)
+      x ^= texelFetch(sobolDirections, ivec2(bit, dim), 0).r;
+  return x;
+}
+
+float toUnitFloat(uint x) { return float(x >> 8) * (1.0 / 16777216.0); }
+
+// The Sobol index is the sample's place in the accumulation, frameIndex. The scramble stays fixed
+// for one accumulation and changes with each reset, so every reset starts a whole new sequence.
+uint scrambleSeed(ivec2 pixel) { return hash(uvec3(pixel + regionOffset, 0x5eedu + (frameSeed - frameIndex))); }
+
+// Advances the pixel's persistent PCG state, once per pixel and sample
+Sampler beginSample(ivec2 pixel)
+{
+  uint p = uint(pixel.y * resolution.x + pixel.x);
+  uint state = pcgState[p] * 747796405u + 2891336453u;
+  pcgState[p] = state;
+  return Sampler(frameIndex, scrambleSeed(pixel), pcg(state));
+}
+
+// Picks up the sample beginSample started for this pixel, in a later pass
+Sampler resumeSample(ivec2 pixel)
+{
+  return Sampler(frameIndex, scrambleSeed(pixel), pcg(pcgState[pixel.y * resolution.x + pixel.x]));
+}
+
+float sample1D(Sampler s, uint dim)
+{
+  if (dim >= uint(SOBOL_DIMS))
+    return toUnitFloat(pcg(s.stream + dim * 0x9e3779b9u));
+  uint index = owenScramble(s.index, s.seed); // shuffles the order, keeps each 2^k block stratified
+  return toUnitFloat(owenScramble(sobol(index, dim), hash(s.seed ^ dim)));
+}
+
+vec2 sample2D(Sampler s, uint dim) { return vec2(sample1D(s, dim), sample1D(s, dim + 1u)); }
+
+// entry distance of the ray into the node's box, or tmax on a miss
+float slabs(BVHNode node, Ray ray, vec3 invDir, float current_tmax)
+{
+  vec3 t0 = (node.lo - ray.o) * invDir;
+  vec3 t1 = (node.hi - ray.o) * invDir;
+  vec3 tn = min(t0, t1), tf = max(t0, t1);
+  float tnear = max(max(tn.x, tn.y), max(tn.z, 0.0));
+  float tfar = min(min(tf.x, tf.y), tf.z);
+  return (tnear <= tfar && tnear < current_tmax) ? tnear : tmax;
+}
 
 Isect intersect(Plane plane, Ray ray, float current_tmax)
 {
-  int i = plane.i.x;
-  vec3 p = vec3(heap[i], heap[i+1], heap[i+2]);
-  vec3 n = normalize(vec3(heap[i+3], heap[i+4], heap[i+5]));
+  vec4 plane_eq = planes[plane.i.x];
+  vec3 n = plane_eq.xyz;
   float denom = dot(ray.d, n);
   if (denom != 0) {
-    float t = dot(p-ray.o, n) / denom;
+    float t = (plane_eq.w - dot(ray.o, n)) / denom;
     if (t > tmin && t < current_tmax)
       return Isect(t, ray.o+ray.d*t, n, plane.i.y);
   }
@@ -70,12 +260,11 @@ Isect intersect(Plane plane, Ray ray, float current_tmax)
 
 Isect intersect(Sphere sphere, Ray ray, float current_tmax)
 {
-  int i = sphere.i.x;
-  vec3 c = vec3(heap[i], heap[i+1], heap[i+2]);
-  float r = heap[i+3];
+  vec4 sphere_eq = spheres[sphere.i.x];
+  vec3 c = sphere_eq.xyz;
   float t = -1.0;
   float B = 2 * dot(ray.o-c, ray.d);
-  float C = pow(length(ray.o-c), 2) - r * r;
+  float C = dot(ray.o-c, ray.o-c) - sphere_eq.w;
   float D = pow(B,2) - 4 * C;
   if (D >= -tmin) { // (D < 0) => no solution
     float sol = (-B - sqrt(D)) / 2.0;
@@ -92,77 +281,328 @@ Isect intersect(Sphere sphere, Ray ray, float current_tmax)
   return Isect(-1, vec3(0), vec3(0), -1);
 }
 
+// any-hit tests for shadow rays: only whether something lies in (tmin, max_t), no hit record
+bool occludes(Plane plane, Ray ray, float max_t)
+{
+  vec4 plane_eq = planes[plane.i.x];
+  float denom = dot(ray.d, plane_eq.xyz);
+  float t = (plane_eq.w - dot(ray.o, plane_eq.xyz)) / denom;
+  return denom != 0 && t > tmin && t < max_t;
+}
+
+bool occludes(Sphere sphere, Ray ray, float max_t)
+{
+  vec4 sphere_eq = spheres[sphere.i.x];
+  vec3 oc = ray.o - sphere_eq.xyz;
+  float b = dot(oc, ray.d);
+  float D = b*b - dot(oc, oc) + sphere_eq.w;
+  if (D < 0)
+    return false;
+  float sqrtD = sqrt(D);
+  float t0 = -b - sqrtD, t1 = -b + sqrtD;
+  return (t0 > tmin && t0 < max_t) || (t1 > tmin && t1 < max_t);
+}
+
+// Mesh rays are traced in object space: o' = (o - position) / scale keeps the direction, so t = scale * t'
+float meshScale(Mesh mesh) { return meshes[mesh.i.x].w; }
+Ray meshRay(Mesh mesh, Ray ray)
+{
+  vec4 placement = meshes[mesh.i.x];
+  return Ray((ray.o - placement.xyz) / placement.w, ray.d);
+}
+
+// Watertight ray/triangle test (Woop, Benthin, Wald 2013). The axis permutation and shear that map
+// the ray onto +z are set up once per ray, so each triangle costs three 2D edge functions that
+// agree exactly along shared edges: no cracks between the triangles of a mesh.
+struct ShearedRay { vec3 o; ivec3 k; vec3 S; };
+
+ShearedRay shear(Ray ray)
+{
+  vec3 ad = abs(ray.d);
+  int kz = (ad.x > ad.y) ? ((ad.x > ad.z) ? 0 : 2) : ((ad.y > ad.z) ? 1 : 2);
+  int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+  if (ray.d[kz] < 0.0) { // keep the winding
+    int swap_k = kx; kx = ky; ky = swap_k;
+  }
+  return ShearedRay(ray.o, ivec3(kx, ky, kz), vec3(ray.d[kx], ray.d[ky], 1.0) / ray.d[kz]);
+}
+
+// distance to the triangle if it lies in (t_lo, t_hi), -1 otherwise
+float intersectTriangle(ShearedRay r, uvec4 face, float t_lo, float t_hi)
+{
+  vec3 A = vertices[face.x].xyz - r.o;
+  vec3 B = vertices[face.y].xyz - r.o;
+  vec3 C = vertices[face.z].xyz - r.o;
+  float Ax = A[r.k.x] - r.S.x*A[r.k.z], Ay = A[r.k.y] - r.S.y*A[r.k.z];
+  float Bx = B[r.k.x] - r.S.x*B[r.k.z], By = B[r.k.y] - r.S.y*B[r.k.z];
+  float Cx = C[r.k.x] - r.S.x*C[r.k.z], Cy = C[r.k.y] - r.S.y*C[r.k.z];
+  float U = Cx*By - Cy*Bx;
+  float V = Ax*Cy - Ay*Cx;
+  float W = Bx*Ay - By*Ax;
+  if ((U < 0.0 || V < 0.0 || W < 0.0) && (U > 0.0 || V > 0.0 || W > 0.0))
+    return -1.0;
+  float det = U + V + W;
+  if (det == 0.0)
+    return -1.0;
+  float t = r.S.z*(U*A[r.k.z] + V*B[r.k.z] + W*C[r.k.z]) / det;
+  return (t > t_lo && t < t_hi) ? t : -1.0;
+}
+
+Isect intersect(Mesh mesh, Ray ray, float current_tmax)
+{
+  float scale = meshScale(mesh);
+  Ray local = meshRay(mesh, ray);
+  ShearedRay sheared = shear(local);
+  vec3 invDir = 1.0 / local.d;
+  float t_lo = tmin / scale, t_hi = current_tmax / scale;
+  int hit_face = -1;
+  int stack[bvhStackSize];
+  int sp = 0;
+  int node = mesh.i.z;
+  if (slabs(meshBVH[node], local, invDir, t_hi) == tmax)
+    return Isect(-1, vec3(0), vec3(0), -1);
+  while (true) {
+    if (meshBVH[node].count > 0) {
+      for (int f = meshBVH[node].offset; f < meshBVH[node].offset + meshBVH[node].count; f++) {
+        float t = intersectTriangle(sheared, faces[f], t_lo, t_hi);
+        if (t > 0) {
+          t_hi = t;
+          hit_face = f;
+        }
+      }
+    }
+    else {
+      int closer = node + 1, further = meshBVH[node].offset;
+      float t_closer = slabs(meshBVH[closer], local, invDir, t_hi);
+      float t_further = slabs(meshBVH[further], local, invDir, t_hi);
+      if (t_further < t_closer) {
+        int swap_node = closer; closer = further; further = swap_node;
+        float swap_t = t_closer; t_closer = t_further; t_further = swap_t;
+      }
+      if (t_closer < tmax) {
+        if (t_further < tmax && sp < bvhStackSize)
+          stack[sp++] = further;
+        node = closer;
+        continue;
+      }
+    }
+    if (sp == 0)
+      break;
+    node = stack[--sp];
+  }
+  if (hit_face == -1)
+    return Isect(-1, vec3(0), vec3(0), -1);
+  uvec4 f = faces[hit_face];
+  vec3 a = vertices[f.x].xyz;
+  vec3 n = normalize(cross(vertices[f.y].xyz - a, vertices[f.z].xyz - a));
+  float t = t_hi * scale;
+  return Isect(t, ray.o+ray.d*t, n, mesh.i.y);
+}
+
+bool occludes(Mesh mesh, Ray ray, float max_t)
+{
+  float scale = meshScale(mesh);
+  Ray local = meshRay(mesh, ray);
+  ShearedRay sheared = shear(local);
+  vec3 invDir = 1.0 / local.d;
+  float t_lo = tmin / scale, t_hi = max_t / scale;
+  int stack[bvhStackSize];
+  int sp = 0;
+  stack[sp++] = mesh.i.z;
+  while (sp > 0) {
+    int node = stack[--sp];
+    if (slabs(meshBVH[node], local, invDir, t_hi) == tmax)
+      continue;
+    if (meshBVH[node].count > 0) {
+      for (int f = meshBVH[node].offset; f < meshBVH[node].offset + meshBVH[node].count; f++)
+        if (intersectTriangle(sheared, faces[f], t_lo, t_hi) > 0)
+          return true;
+    }
+    else if (sp + 2 <= bvhStackSize) {
+      stack[sp++] = meshBVH[node].offset;
+      stack[sp++] = node + 1;
+    }
+  }
+  return false;
+}
+
+bool checkOcclusion(Ray ray, int i, float max_t)
+{
+  switch (gbuf[i].x) {
+#if (SCENE_SHAPES & 1) != 0
+    case 0: return occludes(Plane(gbuf[i].yz), ray, max_t);
+#endif
+#if (SCENE_SHAPES & 2) != 0
+    case 1: return occludes(Sphere(gbuf[i].yz), ray, max_t);
+#endif
+#if (SCENE_SHAPES & 4) != 0
+    case 2: return occludes(Mesh(gbuf[i].yzw), ray, max_t);
+#endif
+    default: break;
+  }
+  return false;
+}
+
 Isect checkIsect(Ray ray, int i, float current_tmax)
 {
   switch (gbuf[i].x) {
+#if (SCENE_SHAPES & 1) != 0
     case 0: return intersect(Plane(gbuf[i].yz), ray, current_tmax);
+#endif
+#if (SCENE_SHAPES & 2) != 0
     case 1: return intersect(Sphere(gbuf[i].yz), ray, current_tmax);
-    case 2: break;
+#endif
+#if (SCENE_SHAPES & 4) != 0
+    case 2: return intersect(Mesh(gbuf[i].yzw), ray, current_tmax);
+#endif
+    default: break;
   }
   return Isect(-1, vec3(0), vec3(0), -1);
 }
 
+#if !SCENE_UNROLLED
 Isect castRay(Ray ray)
 {
   float current_min_t = tmax;
   Isect result = Isect(-1, vec3(0), vec3(0), -1);
-  for (int i = 0; i < numShapes; i++) {
+  for (int i = numBounded; i < numShapes; i++) {
     Isect hit = checkIsect(ray, i, current_min_t);
     if (hit.t > 0) {
       current_min_t = hit.t;
       result = Isect(hit.t, hit.position, hit.normal, hit.material_idx);
     }
   }
+  vec3 invDir = 1.0 / ray.d;
+  if (numBounded == 0 || slabs(bvh[0], ray, invDir, current_min_t) == tmax)
+    return result;
+  int stack[bvhStackSize];
+  int sp = 0;
+  int node = 0;
+  while (true) {
+    if (bvh[node].count > 0) {
+      for (int i = bvh[node].offset; i < bvh[node].offset + bvh[node].count; i++) {
+        Isect hit = checkIsect(ray, i, current_min_t);
+        if (hit.t > 0) {
+          current_min_t = hit.t;
+          result = Isect(hit.t, hit.position, hit.normal, hit.material_idx);
+        }
+      }
+    }
+    else {
+      // descend into the nearer child, defer the farther one
+      int closer = node + 1, further = bvh[node].offset;
+      float t_closer = slabs(bvh[closer], ray, invDir, current_min_t);
+      float t_further = slabs(bvh[further], ray, invDir, current_min_t);
+      if (t_further < t_closer) {
+        int swap_node = closer; closer = further; further = swap_node;
+        float swap_t = t_closer; t_closer = t_further; t_further = swap_t;
+      }
+      if (t_closer < tmax) {
+        if (t_further < tmax && sp < bvhStackSize)
+          stack[sp++] = further;
+        node = closer;
+        continue;
+      }
+    }
+    if (sp == 0)
+      break;
+    node = stack[--sp];
+  }
   return result;
 }
 
+bool occluded(Ray ray, float max_t)
+{
+  for (int i = numBounded; i < numShapes; i++)
+    if (checkOcclusion(ray, i, max_t))
+      return true;
+  if (numBounded == 0)
+    return false;
+  vec3 invDir = 1.0 / ray.d;
+  int stack[bvhStackSize];
+  int sp = 0;
+  stack[sp++] = 0;
+  while (sp > 0) {
+    int node = stack[--sp];
+    if (slabs(bvh[node], ray, invDir, max_t) == tmax)
+      continue;
+    if (bvh[node].count > 0) {
+      for (int i = bvh[node].offset; i < bvh[node].offset + bvh[node].count; i++)
+        if (checkOcclusion(ray, i, max_t))
+          return true;
+    }
+    else if (sp + 2 <= bvhStackSize) {
+      stack[sp++] = bvh[node].offset;
+      stack[sp++] = node + 1;
+    }
+  }
+  return false;
+}
+
+#endif
+
 Light _sample(Directional light, vec3 shadingPoint)
 {
-  int i = light.i;
+  LightRecord record = lights[light.i];
   vec3 lp = vec3(1./0., 0., 0.);
-  vec3 ld = vec3(heap[i+0], heap[i+1], heap[i+2]);
-  vec3 lc = vec3(heap[i+3], heap[i+4], heap[i+5]);
-  return Light(lp, lc, normalize(ld));
+  return Light(lp, record.color.rgb, record.direction.xyz);
 }
 
 Light _sample(Point light, vec3 sp)
 {
-  int i = light.i;
-  vec3 lp = vec3(heap[i+0], heap[i+1], heap[i+2]);
-  vec3 lc = vec3(heap[i+3], heap[i+4], heap[i+5]);
-  float li = heap[i+6];
+  LightRecord record = lights[light.i];
+  vec3 lp = record.position.xyz;
   vec3 ld = lp - sp;
-  return Light(lp, li*lc/pow(length(ld),2), normalize(ld));
+  return Light(lp, record.params.y*record.color.rgb/dot(ld, ld), normalize(ld));
 }
 
 Light _sample(Spot light, vec3 sp)
 {
-  int i = light.i;
-  vec3 lp = vec3(heap[i+0], heap[i+1], heap[i+2]);
-  vec3 ld = vec3(heap[i+3], heap[i+4], heap[i+5]);
-  vec3 lc = vec3(heap[i+6], heap[i+7], heap[i+8]);
-  float li = heap[i+9];
-  float lr = heap[i+10];
-  float la = heap[i+11];
+  LightRecord record = lights[light.i];
+  vec3 lp = record.position.xyz;
+  vec3 lc = record.color.rgb;
   const float le = 50.0;
   vec3 lightToPoint = sp - lp;
-  float cos_ld = dot(normalize(lightToPoint), normalize(ld));
-  if (cos_ld > cos(la*pi/360.))
-    lc *= li / pow(length(lightToPoint),2) * pow(cos_ld, le);
+  float cos_ld = dot(normalize(lightToPoint), record.direction.xyz);
+  if (cos_ld > record.params.x)
+    lc *= record.params.y / dot(lightToPoint, lightToPoint) * pow(cos_ld, le);
   else
     lc = ambient;
   return Light(lp, lc, normalize(lightToPoint));
 }
 
+#if SCENE_UNROLLED
+// castRay, occluded and getLightSample written out per object of the scene
+#pragma scene
+#else
 Light getLightSample(int i, vec3 shadingPoint)
 {
   switch (lbuf[i].x) { // switch l_type: pass l_index
+#if (SCENE_LIGHTS & 1) != 0
     case 0: return _sample(Directional(lbuf[i].y), shadingPoint);
+#endif
+#if (SCENE_LIGHTS & 2) != 0
     case 1: return _sample(Point(lbuf[i].y), shadingPoint);
+#endif
+#if (SCENE_LIGHTS & 4) != 0
     case 2: return _sample(Spot(lbuf[i].y), shadingPoint);
+#endif
+    default: break;
   }
   return Light(vec3(0), vec3(0), vec3(0));
 }
+#endif
+
+// unshadowed light reflected towards the viewer by a diffuse or specular material
+vec3 reflectance(Ray ray, Isect isect, ivec2 m, Light light, vec3 l)
+{
+  vec3 n = isect.normal;
+  vec3 v = ray.d;
+  vec3 r = reflect(l, n);
+  vec3 diffuse = vec3(heap[m.y+3],heap[m.y+4],heap[m.y+5]) * max(dot(n,l), 0.0);
+  vec3 specular = isMaterial(m, 1) ? vec3(heap[m.y+6],heap[m.y+7],heap[m.y+8]) * pow(max(dot(r,v), 0.0),heap[m.y+9]) : vec3(0);
+  return light.color * (specular + diffuse);
+}
 
 vec3 shading(Ray ray, Isect isect)
 {
@@ -173,15 +613,9 @@ vec3 shading(Ray ray, Isect isect)
     vec3 pointToLight = light.position - isect.position;
     vec3 l = normalize(pointToLight);
     Ray shadowRay = Ray(isect.position, l);
-    Isect shadowIsect = castRay(shadowRay);
-    if (shadowIsect.t > tmin && shadowIsect.t < length(pointToLight))
+    if (occluded(shadowRay, length(pointToLight)))
       continue;
-    vec3 n = isect.normal;
-    vec3 v = ray.d;
-    vec3 r = reflect(l, n);
-    vec3 diffuse = vec3(heap[m.y+3],heap[m.y+4],heap[m.y+5]) * max(dot(n,l), 0.0);
-    vec3 specular = (m.x == 1) ? vec3(heap[m.y+6],heap[m.y+7],heap[m.y+8]) * pow(max(dot(r,v), 0.0),heap[m.y+9]) : vec3(0);
-    color += light.color * (specular + diffuse);
+    color += reflectance(ray, isect, m, light, l);
   }
   return ambient * vec3(heap[m.y],heap[m.y+1],heap[m.y+2]) + color;
 }
@@ -193,70 +627,318 @@ vec3 uniformSampleHemisphere(float r1, float r2)
   return vec3(sin_theta*cos(phi), r1, sin_theta*sin(phi));
 }
 
-vec3 computeIndirectDiffuse(uvec2 pixel, Isect isect)
+// hemisphere sample around n, in world space
+vec3 sampleHemisphere(vec3 n, float r1, float r2)
 {
-  const uint N = 100u;
-  vec3 indirectDiffuse = vec3(0);
-  vec3 nb, nt, n = isect.normal;
+  vec3 nb, nt;
   nt = abs(n.x) > abs(n.y) ? vec3(n.z,0,-n.x)/sqrt(n.x*n.x+n.z*n.z) : vec3(0,-n.z,n.y)/sqrt(n.y*n.y+n.z*n.z);
   nb = cross(n, nt);
-  uint hitCount = 0;
+  vec3 sRay = uniformSampleHemisphere(r1, r2);
+  return vec3(
+    sRay.x*nb.x + sRay.y*n.x + sRay.z*nt.x,
+    sRay.x*nb.y + sRay.y*n.y + sRay.z*nt.y,
+    sRay.x*nb.z + sRay.y*n.z + sRay.z*nt.z
+  );
+}
+
+// the i-th of the N samples takes the dimensions of bounce (bounce + i)
+vec3 computeIndirectDiffuse(Sampler s, int bounce, uint N, Isect isect)
+{
+  vec3 indirectDiffuse = vec3(0);
   for (uint i = 0u; i < N; i++) {
-    float r1 = random(uvec3(pixel.xy, i));
-    float r2 = random(uvec3(pixel.xy, i));
-    vec3 sRay = uniformSampleHemisphere(r1, r2);
-    vec3 sampleWorld = vec3(
-      sRay.x*nb.x + sRay.y*n.x + sRay.z*nt.x,
-      sRay.x*nb.y + sRay.y*n.y + sRay.z*nt.y,
-      sRay.x*nb.z + sRay.y*n.z + sRay.z*nt.z
-    );
+    vec2 r = sample2D(s, bounceDimension(bounce + int(i), 0u));
+    float r1 = r.x, r2 = r.y;
+    vec3 sampleWorld = sampleHemisphere(isect.normal, r1, r2);
     Ray sampleRay = Ray(isect.position+sampleWorld, sampleWorld);
     Isect tsect = castRay(sampleRay);
     if (tsect.t > 0) {
       ivec2 mi = mbuf[tsect.material_idx];
-      if (mi.x == 0 || mi.x == 1) {
+      if (isMaterial(mi, 0) || isMaterial(mi, 1)) {
         indirectDiffuse += r1 * shading(sampleRay, tsect);
-        hitCount += 1;
       }
     }
   }
   return indirectDiffuse / N;
 }
 
+Ray primaryRay(ivec2 pixel, Sampler s)
+{
+  vec2 jitter = vec2(0);
+  if (accumulate)
+    jitter = sample2D(s, dimPixel);
+  float x = (float(pixel.x) + jitter.x) / float(resolution.x);
+  float y = (float(resolution.y - 1 - pixel.y) + jitter.y) / float(resolution.y);
+  return Ray(cam.eye, normalize((cam.corner+cam.across*x+cam.up*y)-cam.eye));
+}
+
+float luminance(vec3 c) { return dot(c, vec3(0.2126, 0.7152, 0.0722)); }
+
+// Pixel through which the previous camera saw point p, (-1,-1) if it was behind or off screen
+ivec2 previousPixel(vec3 p)
+{
+  vec3 D = p - prevCam.eye, C = prevCam.corner - prevCam.eye;
+  vec3 N = cross(prevCam.across, prevCam.up);
+  float k = dot(D, N) / dot(C, N); // D / k lies on the image plane
+  if (k <= 0.0)
+    return ivec2(-1);
+  vec3 Q = D / k - C;
+  float x = dot(Q, prevCam.across) / dot(prevCam.across, prevCam.across);
+  float y = dot(Q, prevCam.up) / dot(prevCam.up, prevCam.up);
+  ivec2 prev = ivec2(floor(vec2(x, 1.0 - y) * vec2(resolution)));
+  return (any(lessThan(prev, ivec2(0))) || any(greaterThanEqual(prev, resolution))) ? ivec2(-1) : prev;
+}
+
+// Accumulated { mean, count } this pixel continues from. After a camera move it is the previous frame's
+// pixel that saw the same primary hit, kept only if its distance and normal agree (disocclusions fail).
+vec4 fetchHistory(ivec2 pixel, Ray ray, Isect primary, out float m2)
+{
+  m2 = 0.0;
+  if (!reproject) {
+    if (frameIndex == 0u)
+      return vec4(0);
+    m2 = imageLoad(moment_image, pixel).r;
+    return imageLoad(accum_image, pixel);
+  }
+  bool hit = primary.t > 0;
+  vec3 p = hit ? primary.position : ray.o + ray.d * 1e4; // misses reproject by direction
+  ivec2 prev = previousPixel(p);
+  if (prev.x < 0)
+    return vec4(0);
+  vec4 g = imageLoad(prev_gbuffer_image, prev);
+  bool similar = hit ? (g.w > 0.0 && abs(g.w - distance(p, prevCam.eye)) < 0.05 * g.w && dot(g.xyz, primary.normal) > 0.9)
+                     : g.w == 0.0;
+  if (!similar)
+    return vec4(0);
+  vec4 h = imageLoad(prev_accum_image, prev);
+  return vec4(h.rgb, min(h.a, maxHistory));
+}
+
+void storePixel(ivec2 pixel, vec3 pixel_color, Ray ray, Isect primary)
+{
+  pixel_color = clamp(pixel_color, 0.0, 1.0);
+  if (accumulate) {
+    float m2;
+    vec4 history = fetchHistory(pixel, ray, primary, m2);
+    float n = history.a + 1.0;
+    vec3 mean = history.rgb + (pixel_color - history.rgb) / n;
+    m2 += (luminance(pixel_color) - luminance(history.rgb)) * (luminance(pixel_color) - luminance(mean));
+    imageStore(moment_image, pixel, vec4(m2));
+    imageStore(accum_image, pixel, vec4(mean, n));
+    imageStore(gbuffer_image, pixel, vec4(primary.normal, max(primary.t, 0.0)));
+    pixel_color = mean;
+  }
+  imageStore(render_image, pixel, vec4(pixel_color,1));
+}
+
+
+#if STAGE == STAGE_MEGAKERNEL
+
+// tiles are numbered row-major over the grid the converge pass is dispatched on
+ivec2 tileOrigin(uint tile)
+{
+  uint tilesX = uint(resolution.x + TILE_W - 1) / uint(TILE_W);
+  return ivec2(tile % tilesX, tile / tilesX) * ivec2(TILE_W, TILE_H);
+}
 
 void main()
 {
-  float x = float(gl_GlobalInvocationID.x) / 960.0;
-  float y = (639.0 - float(gl_GlobalInvocationID.y)) / 640.0;
+  ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+  if (adaptive)
+    pixel = tileOrigin(activeTiles[gl_WorkGroupID.x]) + ivec2(gl_LocalInvocationID.xy);
+  if (any(greaterThanEqual(pixel, min(resolution, regionSize))))
+    return;
   Ray ray[maxDepth+1];
   ivec2 m[maxDepth+1];
-  ray[0] = Ray(cam.eye, normalize((cam.corner+cam.across*x+cam.up*y)-cam.eye));
+  Sampler s = beginSample(pixel);
+  ray[0] = primaryRay(pixel, s);
   vec3 pixel_color = vec3(0);
+  Isect primary = Isect(-1, vec3(0), vec3(0), -1);
   for (int i = 0; i < maxDepth; i++) {
     Isect isect = castRay(ray[i]);
+    if (i == 0)
+      primary = isect;
     if (isect.t > 0) {
       m[i] = mbuf[isect.material_idx].xy;
-      if (m[i].x == 0 || m[i].x == 1) {
-        if (i > 0 && m[i-1].x == 2) {
+      if (isMaterial(m[i], 0) || isMaterial(m[i], 1)) {
+        if (i > 0 && isMaterial(m[i-1], 2)) {
           pixel_color += vec3(heap[m[i-1].y], heap[m[i-1].y+1], heap[m[i-1].y+2]) * shading(ray[i], isect);
         }
-        else if (i > 0 && m[i-1].x == 3) {
+        else if (i > 0 && isMaterial(m[i-1], 3)) {
           pixel_color += vec3(heap[m[i-1].y], heap[m[i-1].y+1], heap[m[i-1].y+2]) * shading(ray[i], isect);
         }
         else {
           pixel_color += shading(ray[i], isect);
-          // pixel_color += computeIndirectDiffuse(gl_GlobalInvocationID.xy, isect);
+          if (accumulate)
+            pixel_color += computeIndirectDiffuse(s, i, 1u, isect);
         }
         break;
       }
-      if (m[i].x == 2)
+      if (isMaterial(m[i], 2))
         ray[i+1] = Ray(isect.position, reflect(ray[i].d, isect.normal));
-      if (m[i].x == 3)
+      if (isMaterial(m[i], 3))
         ray[i+1] = Ray(isect.position, refract(-ray[i].d, isect.normal, heap[m[i].y+3]));
     }
     else break;
   }
-  pixel_color = clamp(pixel_color, 0.0, 1.0);
-  imageStore(render_image, ivec2(gl_GlobalInvocationID.xy), vec4(pixel_color,1));
+  storePixel(pixel, pixel_color, ray[0], primary);
 }
+
+#elif STAGE == STAGE_CONVERGE
+
+// One group per tile: the tile stays active while its worst pixel's error is above the threshold
+shared uint tileError;
+
+void main()
+{
+  if (gl_LocalInvocationIndex == 0u)
+    tileError = 0u;
+  barrier();
+  ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+  if (all(lessThan(pixel, resolution))) {
+    vec4 mean = imageLoad(accum_image, pixel);
+    float n = mean.a;
+    float m2 = imageLoad(moment_image, pixel).r;
+    float error = (n < 2.0) ? 1e30 : sqrt(max(m2, 0.0) / (n * (n - 1.0))) / (luminance(mean.rgb) + 1e-3);
+    atomicMax(tileError, floatBitsToUint(error)); // non-negative floats order like their bits
+  }
+  barrier();
+  if (gl_LocalInvocationIndex == 0u && uintBitsToFloat(tileError) > errorThreshold)
+    activeTiles[atomicAdd(activeTileArgs.x, 1u)] = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+}
+
+#else // wavefront passes
+
+uniform int depth;
+uniform int waveOffset;   // first pixel of the wave
+uniform int waveCount;    // pixels in the wave
+uniform int waveCapacity; // paths per ray queue half
+uniform int argsFor;      // queue whose dispatch size STAGE_ARGS computes: 0 rays, 1 hits, 2 shadow rays
+const float radianceScale = 65536.0;
+const uint pathIndirect = 1u; // indirect diffuse paths end at the first non-diffuse hit
+
+void addRadiance(uint pixel, vec3 c)
+{
+  // the resolved color is clamped to 1, so clamping each non-negative term first changes nothing
+  uvec3 fixed_c = uvec3(clamp(c, 0.0, 1.0) * radianceScale);
+  if (fixed_c.r > 0u) atomicAdd(radiance[3u*pixel], fixed_c.r);
+  if (fixed_c.g > 0u) atomicAdd(radiance[3u*pixel+1u], fixed_c.g);
+  if (fixed_c.b > 0u) atomicAdd(radiance[3u*pixel+2u], fixed_c.b);
+}
+
+void pushRay(vec3 o, vec3 d, uint pixel, uint flags, vec3 throughput)
+{
+  uint next = uint((depth + 1) & 1);
+  uint slot = next * uint(waveCapacity) + atomicAdd(rayCount[next], 1u);
+  rays[slot] = PathRay(vec4(o, uintBitsToFloat(pixel)), vec4(d, uintBitsToFloat(flags)), vec4(throughput, 0));
+}
+
+#if STAGE == STAGE_GENERATE
+
+void main()
+{
+  if (gl_GlobalInvocationID.x >= uint(waveCount))
+    return;
+  int p = waveOffset + int(gl_GlobalInvocationID.x);
+  int width = resolution.x;
+  ivec2 pixel = ivec2(p % width, p / width);
+  Ray ray = primaryRay(pixel, beginSample(pixel));
+  uint slot = atomicAdd(rayCount[0], 1u);
+  rays[slot] = PathRay(vec4(ray.o, uintBitsToFloat(uint(p))), vec4(ray.d, uintBitsToFloat(0u)), vec4(1));
+}
+
+#elif STAGE == STAGE_EXTEND
+
+void main()
+{
+  uint current = uint(depth & 1);
+  if (gl_GlobalInvocationID.x >= rayCount[current])
+    return;
+  uint slot = current * uint(waveCapacity) + gl_GlobalInvocationID.x;
+  Isect isect = castRay(Ray(rays[slot].o.xyz, rays[slot].d.xyz));
+  if (isect.t > 0)
+    hits[atomicAdd(hitCount, 1u)] = PathHit(vec4(isect.position, isect.t), vec4(isect.normal, 0), ivec4(slot, isect.material_idx, 0, 0));
+}
+
+#elif STAGE == STAGE_SHADE
+
+void main()
+{
+  if (gl_GlobalInvocationID.x >= hitCount)
+    return;
+  PathHit hit = hits[gl_GlobalInvocationID.x];
+  PathRay path = rays[hit.i.x];
+  Ray ray = Ray(path.o.xyz, path.d.xyz);
+  Isect isect = Isect(hit.position.w, hit.position.xyz, hit.normal.xyz, hit.i.y);
+  uint pixel = floatBitsToUint(path.o.w);
+  uint flags = floatBitsToUint(path.d.w);
+  ivec2 m = mbuf[isect.material_idx];
+  if (isMaterial(m, 0) || isMaterial(m, 1)) {
+    addRadiance(pixel, path.throughput.rgb * ambient * vec3(heap[m.y],heap[m.y+1],heap[m.y+2]));
+    for (int li = 0; li < numLights; li++) {
+      Light light = getLightSample(li, isect.position);
+      vec3 pointToLight = light.position - isect.position;
+      vec3 l = normalize(pointToLight);
+      vec3 contribution = path.throughput.rgb * reflectance(ray, isect, m, light, l);
+      if (any(greaterThan(contribution, vec3(0))))
+        shadows[atomicAdd(shadowCount, 1u)] = ShadowRay(vec4(isect.position, length(pointToLight)), vec4(l, uintBitsToFloat(pixel)), vec4(contribution, 0));
+    }
+    if (accumulate && depth == 0 && depth + 1 < maxDepth) {
+      int width = resolution.x;
+      Sampler s = resumeSample(ivec2(pixel % uint(width), pixel / uint(width)));
+      vec2 r = sample2D(s, bounceDimension(depth, 0u));
+      float r1 = r.x, r2 = r.y;
+      vec3 sampleWorld = sampleHemisphere(isect.normal, r1, r2);
+      pushRay(isect.position+sampleWorld, sampleWorld, pixel, pathIndirect, path.throughput.rgb * r1);
+    }
+  }
+  else if ((flags & pathIndirect) == 0u && depth + 1 < maxDepth) {
+    // mirrors and glass weight whatever the continued path hits by their kr, compounding over bounces
+    vec3 kr = vec3(heap[m.y], heap[m.y+1], heap[m.y+2]);
+    vec3 d = isMaterial(m, 2) ? reflect(ray.d, isect.normal) : refract(-ray.d, isect.normal, heap[m.y+3]);
+    pushRay(isect.position, d, pixel, flags, path.throughput.rgb * kr);
+  }
+}
+
+#elif STAGE == STAGE_CONNECT
+
+void main()
+{
+  if (gl_GlobalInvocationID.x >= shadowCount)
+    return;
+  ShadowRay s = shadows[gl_GlobalInvocationID.x];
+  if (!occluded(Ray(s.o.xyz, s.d.xyz), s.o.w))
+    addRadiance(floatBitsToUint(s.d.w), s.contribution.rgb);
+}
+
+#elif STAGE == STAGE_RESOLVE
+
+void main()
+{
+  if (any(greaterThanEqual(gl_GlobalInvocationID.xy, uvec2(resolution))))
+    return;
+  ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+  uint p = 3u * uint(pixel.y * resolution.x + pixel.x);
+  vec3 color = vec3(radiance[p], radiance[p+1u], radiance[p+2u]) / radianceScale;
+  radiance[p] = 0u;
+  radiance[p+1u] = 0u;
+  radiance[p+2u] = 0u;
+  storePixel(pixel, color, Ray(vec3(0), vec3(0)), Isect(-1, vec3(0), vec3(0), -1)); // never reprojects
+}
+
+#elif STAGE == STAGE_ARGS
+
+void main()
+{
+  uint count = (argsFor == 0) ? rayCount[depth & 1] : (argsFor == 1) ? hitCount : shadowCount;
+  dispatchArgs = uvec4((count + WAVEFRONT_GROUP - 1u) / WAVEFRONT_GROUP, 1u, 1u, 0u);
+  if (argsFor == 0) {
+    hitCount = 0u;
+    rayCount[(depth + 1) & 1] = 0u;
+  }
+  else if (argsFor == 1)
+    shadowCount = 0u;
+}
+
+#endif
+#endif
 #end
\ No newline at end of file
@@ -1,5 +1,5 @@
 #shader vertex
-#version 460
+#version 450
 
 layout (location = 0) in vec4 vbuf;
 out vec2 tex_coords;
@@ -19,15 +19,15 @@ void main()
 }
 
 #shader fragment
-#version 460
+#version 450
 
 in vec2 tex_coords;
 out vec4 frag_color;
 
-layout (RGBA32F, binding = 0) uniform image2D render_image;
+layout (binding = 0) uniform sampler2D render_texture; // bilinear, the render resolution may differ from the window
 
 void main()
 {
-  frag_color = imageLoad(render_image, ivec2(tex_coords.s*960, tex_coords.t*640)).rgba;
+  frag_color = texture(render_texture, tex_coords).rgba;
 }
 #end
\ No newline at end of file
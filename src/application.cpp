@@ -32,35 +32,113 @@ std::string console::date_time()
 #include <SDL_image.h>
 void Application::init_SDL(const char* title, int x, int y, int w, int h, int flags)
 {
-  if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO)<0)
+  if (SDL_Init(title ? SDL_INIT_VIDEO|SDL_INIT_AUDIO : SDL_INIT_EVENTS)<0)
     console::error(SDL_GetError());
   if (IMG_Init(IMG_INIT_PNG)==0)
     console::error(IMG_GetError());
+  if (!title) // headless: events and timers only
+    return;
   sdl_app_data.p_window = SDL_CreateWindow(title, x, y, w, h, flags);
   sdl_app_data.p_key_states = SDL_GetKeyboardState(nullptr);
 }
 
 void Application::init_OGL() 
 {
-  int version_major(0), version_minor(0), profile(0), debug(0), double_buffer(0);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG);
-  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 6);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, app_data.gl_major);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, app_data.gl_minor);
   sdl_app_data.context= SDL_GL_CreateContext(sdl_app_data.p_window);
-  if (!sdl_app_data.context)
+  if (!sdl_app_data.context) {
     console::error("Failed to create OpenGL context\n", SDL_GetError());
-  if (!gladLoadGLLoader((GLADloadproc) SDL_GL_GetProcAddress))
+    app_data.running = false;
+    app_data.exit_code = 1;
+    return; }
+  load_OGL((GLADloadproc) SDL_GL_GetProcAddress);
+}
+
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+// A surfaceless context on the Mesa platform when it's there (llvmpipe on a node without a display
+// or GPU), the default display with a 1x1 pbuffer otherwise
+void Application::init_EGL()
+{
+  EGLDisplay display = EGL_NO_DISPLAY;
+  auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display)
+    display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+    console::error("Failed to initialize EGL, error 0x", std::hex, eglGetError(), std::dec);
+    app_data.running = false;
+    app_data.exit_code = 1;
+    return; }
+  const EGLint config_attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  EGLConfig config;
+  EGLint config_count = 0;
+  eglChooseConfig(display, config_attributes, &config, 1, &config_count);
+  const EGLint context_attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, app_data.gl_major,
+    EGL_CONTEXT_MINOR_VERSION, app_data.gl_minor,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+    EGL_NONE };
+  EGLContext context = eglCreateContext(display, config_count ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attributes);
+  EGLSurface surface = EGL_NO_SURFACE;
+  const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+  if (config_count && !(extensions && std::strstr(extensions, "EGL_KHR_surfaceless_context"))) {
+    const EGLint pbuffer_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    surface = eglCreatePbufferSurface(display, config, pbuffer_attributes); }
+  if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) {
+    console::error("Failed to create a headless OpenGL ", app_data.gl_major, '.', app_data.gl_minor, " context, error 0x",
+                   std::hex, eglGetError(), std::dec);
+    if (context != EGL_NO_CONTEXT)
+      eglDestroyContext(display, context);
+    eglTerminate(display);
+    app_data.running = false;
+    app_data.exit_code = 1;
+    return; }
+  egl_display = display;
+  egl_context = context;
+  load_OGL((GLADloadproc) eglGetProcAddress);
+}
+#else
+void Application::init_EGL()
+{
+  console::error("--headless needs EGL, which this build doesn't use");
+  app_data.running = false;
+  app_data.exit_code = 1;
+}
+#endif
+
+#include <cstring>
+void Application::load_OGL(GLADloadproc load)
+{
+  GLint version_major(0), version_minor(0), profile(0), debug(0);
+  GLboolean double_buffer(GL_FALSE);
+  if (!gladLoadGLLoader(load)) {
     console::error("Unable to load OpenGL function pointers.");
-  SDL_GL_GetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,  &profile);
-  SDL_GL_GetAttribute(SDL_GL_CONTEXT_FLAGS,         &debug);
-  SDL_GL_GetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, &version_major);
-  SDL_GL_GetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, &version_minor);
-  SDL_GL_GetAttribute(SDL_GL_DOUBLEBUFFER,          &double_buffer);
+    app_data.running = false;
+    app_data.exit_code = 1;
+    return; }
+  glGetIntegerv(GL_MAJOR_VERSION,         &version_major);
+  glGetIntegerv(GL_MINOR_VERSION,         &version_minor);
+  glGetIntegerv(GL_CONTEXT_PROFILE_MASK,  &profile);
+  glGetIntegerv(GL_CONTEXT_FLAGS,         &debug);
+  glGetBooleanv(GL_DOUBLEBUFFER,          &double_buffer);
   glEnable(GL_DEBUG_OUTPUT);
   glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
   glDebugMessageCallback(callback, 0);
   glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_TRUE);
+  GLint extension_count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+  for (GLint i = 0; i < extension_count; ++i)
+    if (std::strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_KHR_parallel_shader_compile") == 0) {
+      auto max_compiler_threads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) load("glMaxShaderCompilerThreadsKHR");
+      max_compiler_threads(0xFFFFFFFFu); // as many as the driver likes
+      Shader::parallel_compile = true; }
   std::stringstream context_info;
   context_info
     << "GL Context Info""\n"
@@ -69,60 +147,127 @@ void Application::init_OGL()
     << "hardware renderer: " << glGetString(GL_RENDERER) << '\n'
     << "hardware driver version: " << glGetString(GL_VERSION) << '\n'
     << "current context version: " << version_major << '.' << version_minor
-    << (profile&SDL_GL_CONTEXT_PROFILE_CORE?" (Core Profile)":profile&SDL_GL_CONTEXT_PROFILE_COMPATIBILITY?" (Compatibility Profile)":" (ES Profile)")
-    << (debug&SDL_GL_CONTEXT_DEBUG_FLAG?"\n""debug output is enabled":"")
-    << (double_buffer?"\n""default framebuffer is double-buffered":"") << '\n';
+    << (profile&GL_CONTEXT_CORE_PROFILE_BIT?" (Core Profile)":profile&GL_CONTEXT_COMPATIBILITY_PROFILE_BIT?" (Compatibility Profile)":" (ES Profile)")
+    << (debug&GL_CONTEXT_FLAG_DEBUG_BIT?"\n""debug output is enabled":"")
+    << (double_buffer?"\n""default framebuffer is double-buffered":"")
+    << (egl_context?"\n""headless, no default framebuffer":"") << '\n';
   console::GL_Context_info = context_info.str();
 }
 
+#include <cstdio>
 void Application::init(int argc, char* argv[], int w, int h)
 {
   this->app_data.argc= argc;
   this->app_data.argv= argv;
+  this->app_data.headless= flag("--headless");
+  if (const char *size = option("--size"))
+    std::sscanf(size, "%dx%d", &w, &h);
   this->app_data.width= w;
   this->app_data.height= h;
-  this->init_SDL(argv[0], SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, w, h, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
-  this->init_OGL();
+  this->on_configure();
+  if (app_data.headless) {
+    this->init_SDL(nullptr, 0, 0, 0, 0, 0);
+    if (app_data.gl)
+      this->init_EGL(); }
+  else {
+    this->init_SDL(argv[0], SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, w, h, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+    this->init_OGL(); }
+  if (!app_data.running) // no context, on_init would call GL functions that never loaded
+    return;
+  initialized = true;
   this->on_init();
 }
 
+const char * Application::option(const char *name)
+{
+  for (int i = 2; i < app_data.argc - 1; ++i)
+    if (std::string(app_data.argv[i]) == name)
+      return app_data.argv[i+1];
+  return nullptr;
+}
+
+bool Application::flag(const char *name)
+{
+  for (int i = 2; i < app_data.argc; ++i)
+    if (std::string(app_data.argv[i]) == name)
+      return true;
+  return false;
+}
+
 bool Application::is_running()
 {
   return app_data.running;
 }
 
+void Application::handle_event(SDL_Event event)
+{
+  if (event.type == SDL_QUIT)
+    app_data.running = false;
+  else if (event.type == SDL_WINDOWEVENT) {
+    switch (event.window.event) {
+      case SDL_WINDOWEVENT_RESIZED:
+        app_data.width = event.window.data1;
+        app_data.height = event.window.data2; break;
+      case SDL_WINDOWEVENT_MINIMIZED:
+      case SDL_WINDOWEVENT_HIDDEN:
+        app_data.visible = false; break;
+      case SDL_WINDOWEVENT_RESTORED:
+      case SDL_WINDOWEVENT_SHOWN:
+      case SDL_WINDOWEVENT_EXPOSED:
+        app_data.visible = true; break; }
+    this->on_event(event); }
+  else
+    this->on_event(event);
+}
+
 void Application::step()
 {
-  Uint32 delta_time, frame_begin = SDL_GetTicks();
+  Uint32 delta_time, frame_begin;
   SDL_Event event;
+  // nothing to draw: sleep in the event queue instead of spinning on an unchanged frame
+  if (app_data.headless && !this->needs_update())
+    app_data.running = false;
+  if (!app_data.headless && (!app_data.visible || !this->needs_update()) && SDL_WaitEvent(&event))
+    this->handle_event(event);
+  frame_begin = SDL_GetTicks();
   while (SDL_PollEvent(&event))
-    if (event.type == SDL_QUIT)
-      app_data.running = false;
-    else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_RESIZED) {
-      app_data.width = event.window.data1;
-      app_data.height = event.window.data2; }
-    else
-      this->on_event(event);
+    this->handle_event(event);
+  if (!app_data.running || !app_data.visible || !this->needs_update())
+    return;
   this->on_update();
   delta_time = SDL_GetTicks() - frame_begin;
-  if (delta_time < app_data.ms_per_frame)
+  if (!app_data.headless && delta_time < app_data.ms_per_frame)
     SDL_Delay(app_data.ms_per_frame - delta_time);
   app_data.cma_fdt += (delta_time - app_data.cma_fdt) / (++app_data.frame_count);
 }
 
-void Application::exit()
+int Application::exit()
 {
-  this->on_exit();
-  SDL_GL_DeleteContext(sdl_app_data.context);
-  SDL_DestroyWindow(sdl_app_data.p_window);
+  if (initialized)
+    this->on_exit();
+#ifdef __linux__
+  if (egl_display) {
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(egl_display, egl_context);
+    eglTerminate(egl_display); }
+#endif
+  if (sdl_app_data.context)
+    SDL_GL_DeleteContext(sdl_app_data.context);
+  if (sdl_app_data.p_window)
+    SDL_DestroyWindow(sdl_app_data.p_window);
   IMG_Quit();
   SDL_Quit();
+  return app_data.exit_code;
 }
 
+void Application::on_configure() {}
+
 void Application::on_init() {}
 
 void Application::on_event(SDL_Event) {}
 
+bool Application::needs_update() { return true; }
+
 void Application::on_update() {}
 
 void Application::on_exit() {}
@@ -136,63 +281,218 @@ void callback(GLenum debug_source, GLenum, GLuint, GLenum, GLsizei, const GLchar
 
 
 
+void Shader::define(const char *name, std::string value)
+{
+  for (auto &d : defines)
+    if (d.first == name) {
+      d.second = value;
+      return; }
+  defines.emplace_back(name, value);
+}
+
+void Shader::generate(std::string code)
+{
+  generated = code;
+}
+
+// Identifies the program source(path) would build with the current defines and generated code
+std::string Shader::key(const char *path)
+{
+  std::string k(path);
+  for (auto &d : defines)
+    k += '\n' + d.first + ' ' + d.second;
+  return k + '\n' + generated;
+}
+
+// Switches to an already linked program, e.g. a cached variant of this shader
+void Shader::adopt(GLuint program)
+{
+  handle = program;
+  uniform_location_map.clear();
+  nonexistent_uniform_set.clear();
+}
+
+#include <cctype>
 #include <fstream>
 void Shader::source(const char *path, bool) // bool remake
 {
-  int shader_index(0);
+  std::size_t shader_index(0);
   std::ifstream ifs(path);
-  std::stringstream ss[5];
+  std::vector<std::stringstream> ss(shaderHandles.size());
   std::string line;
   this->file_path = path;
+  sources.clear();
   auto line_contains = [&line](std::string phrase) { return line.find(phrase) != std::string::npos; };
+  // a directive starts the trimmed line as a whole word, "#end" mustn't match "#endif"
+  auto line_is = [&line](std::string directive) {
+    std::size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line.compare(first, directive.size(), directive) != 0)
+      return false;
+    std::size_t next = first + directive.size();
+    return next == line.size() || !(std::isalnum((unsigned char)line[next]) || line[next] == '_'); };
   getline(ifs, line);
-  if (!line_contains("#shader"))
+  if (!line_is("#shader"))
     console::error("shader files must start with a #shader directive");
   while(getline(ifs, line))
-    if (line_contains("#shader") || line_contains("#end")) {
+    if (line_is("#shader") || line_is("#end")) {
+      if (shader_index >= shaderHandles.size()) {
+        console::error(path, " has more stages than the ", shaderHandles.size(), " it was created with");
+        return; }
       auto source_str = ss[shader_index].str();
       const char* source_code = source_str.c_str();
+      sources.push_back(source_str);
       glShaderSource(shaderHandles[shader_index++], 1, &source_code, nullptr); }
-    else
+    else if (shader_index >= shaderHandles.size())
+      continue;
+    else if (line_contains("#pragma scene"))
+      ss[shader_index] << generated << '\n';
+    else {
       ss[shader_index] << line << '\n';
+      if (line_contains("#version"))
+        for (auto &d : defines)
+          ss[shader_index] << "#define " << d.first << ' ' << d.second << '\n'; }
 }
 
 void Shader::compile()
 {
-  int idx(0);
+  binary_file = binary_path();
+  from_binary = load_binary();
+  if (from_binary)
+    return;
   for (GLuint handle : shaderHandles) {
     glCompileShader(handle);
-    GLint status_errno(0), log_length(0);
-    glGetShaderiv(handle, GL_COMPILE_STATUS, &status_errno);
+    glAttachShader(this->handle, handle); }
+}
+
+// Without wait the driver links in the background: poll ready() and call finish() before use
+void Shader::link(bool wait)
+{
+  if (!from_binary) {
+    glProgramParameteri(this->handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(this->handle); }
+  linking = true;
+  if (wait)
+    finish();
+}
+
+bool Shader::parallel_compile = false;
+
+bool Shader::ready()
+{
+  GLint done(GL_TRUE);
+  if (linking && parallel_compile)
+    glGetProgramiv(this->handle, GL_COMPLETION_STATUS_KHR, &done);
+  return done == GL_TRUE;
+}
+
+// False if the link failed, the log has been printed then
+bool Shader::finish()
+{
+  if (!linking)
+    return true;
+  linking = false;
+  GLint status_errno(1);
+  if (!from_binary) {
+    for (std::size_t idx = 0; idx < shaderHandles.size(); ++idx) {
+      GLint compile_status(0), log_length(0);
+      glGetShaderiv(shaderHandles[idx], GL_COMPILE_STATUS, &compile_status);
+      if (compile_status == 0) {
+        glGetShaderiv(shaderHandles[idx], GL_INFO_LOG_LENGTH, &log_length);
+        GLchar *error_log = new GLchar[log_length];
+        glGetShaderInfoLog(shaderHandles[idx], log_length, nullptr, error_log);
+        error_log[strcspn(error_log,"\n")] = 0;
+        console::log(GLenum_string(shaderTypes[idx]), " unit compilation failed""\n", this->file_path,'\n', error_log);
+        delete[] error_log; } }
+    glGetProgramiv(this->handle, GL_LINK_STATUS, &status_errno);
     if (status_errno == 0) {
-      glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &log_length);
+      GLint log_length(0);
+      glGetProgramiv(this->handle, GL_INFO_LOG_LENGTH, &log_length);
       GLchar *error_log = new GLchar[log_length];
-      glGetShaderInfoLog(handle, log_length, nullptr, error_log);
-      error_log[strcspn(error_log,"\n")] = 0;
-      console::log(GLenum_string(shaderTypes[idx++]), " unit compilation failed""\n", this->file_path,'\n', error_log);
+      glGetProgramInfoLog(this->handle, log_length, nullptr, error_log);
+      error_log[strcspn(error_log,"\0") - 1] = 0;
+      console::error("Failed to link program ",this->handle," (",this->file_path,")\n\n",error_log,'\n');
       delete[] error_log; }
-    glAttachShader(this->handle, handle); }
+    else
+      store_binary(); }
+  uniform_location_map.clear();
+  nonexistent_uniform_set.clear();
+  for (GLuint handle : shaderHandles) {
+    if (!from_binary)
+      glDetachShader(this->handle, handle);
+    glDeleteShader(handle); }
+  return status_errno != 0;
 }
 
-void Shader::link()
+#include <cstdint>
+// Binaries only load into the driver that wrote them, so its strings join the sources in the key
+std::string Shader::binary_path()
 {
-  glLinkProgram(this->handle);
+  std::uint64_t h = 14695981039346656037ull; // FNV-1a
+  auto mix = [&h](std::string s) {
+    for (unsigned char c : s + '\0') {
+      h ^= c;
+      h *= 1099511628211ull; } };
+  for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+    mix(reinterpret_cast<const char*>(glGetString(name)));
+  mix(file_path);
+  for (std::string &s : sources)
+    mix(s);
+  std::stringstream ss;
+  ss << PROGRAM_CACHE_DIR "/" << std::hex << std::setw(16) << std::setfill('0') << h << ".bin";
+  return ss.str();
+}
+
+// Rejected binaries, e.g. after a driver update, leave the program unlinked to be compiled from source
+bool Shader::load_binary()
+{
+  GLint formats(0);
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  std::ifstream ifs(binary_file, std::ios::binary);
+  GLenum format(0);
+  if (formats == 0 || !ifs.read(reinterpret_cast<char*>(&format), sizeof(format)))
+    return false;
+  std::vector<char> binary((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  glProgramBinary(this->handle, format, binary.data(), GLsizei(binary.size()));
   GLint status_errno(0);
   glGetProgramiv(this->handle, GL_LINK_STATUS, &status_errno);
-  if (status_errno == 0) {
-    GLint log_length(0);
-    glGetProgramiv(this->handle, GL_INFO_LOG_LENGTH, &log_length);
-    GLchar *error_log = new GLchar[log_length];
-    glGetProgramInfoLog(this->handle, log_length, nullptr, error_log);
-    error_log[strcspn(error_log,"\0") - 1] = 0;
-    console::error("Failed to link program ",this->handle," (",this->file_path,")\n\n",error_log,'\n');
-    delete[] error_log; }
-  for (GLuint handle : shaderHandles) {
-    glDetachShader(this->handle, handle);
-    glDeleteShader(handle); }
+  return status_errno != 0;
 }
 
-int Shader::loc(const char *name)
+#include <filesystem>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+void Shader::store_binary()
+{
+  GLint formats(0), length(0);
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  glGetProgramiv(this->handle, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (formats == 0 || length == 0)
+    return;
+  std::vector<char> binary(length);
+  GLenum format(0);
+  glGetProgramBinary(this->handle, length, nullptr, &format, binary.data());
+  std::error_code ec;
+  std::filesystem::create_directories(PROGRAM_CACHE_DIR, ec);
+  // written aside and renamed into place, so another process never loads half a binary
+  std::string temp = binary_file + '.' + std::to_string(getpid()) + ".tmp";
+  std::ofstream ofs(temp, std::ios::binary);
+  if (!ofs) {
+    console::log("Warning: can't write the program cache ", temp);
+    return; }
+  ofs.write(reinterpret_cast<char*>(&format), sizeof(format));
+  ofs.write(binary.data(), length);
+  ofs.close();
+  if (ofs)
+    std::filesystem::rename(temp, binary_file, ec);
+  if (!ofs || ec)
+    std::filesystem::remove(temp, ec);
+}
+
+int Shader::loc(const char *name, bool quiet)
 {
   if (uniform_location_map.find(name) != uniform_location_map.end())
     return uniform_location_map[name];
@@ -201,7 +501,7 @@ int Shader::loc(const char *name)
   int location = glGetUniformLocation(handle, name);
   if (location == -1) {
     nonexistent_uniform_set.insert(name);
-    console::log("\nWarning: \"", name, "\" is not an active uniform of program ", handle, ", it doesn't exist or the OpenGL Compiler has optimized it out."); }
+    if (!quiet) console::log("\nWarning: \"", name, "\" is not an active uniform of program ", handle, ", it doesn't exist or the OpenGL Compiler has optimized it out."); }
   else
     uniform_location_map[name] = location;
   return location;
@@ -309,23 +609,52 @@ std::string GLenum_string(GLenum e) {
 
 
 
-#include <regex>
-void parseOBJ(const char* file) {
+#include <cctype>
+#include <cstdlib>
+// Reads the v and f records of a Wavefront OBJ file; polygons are fanned into triangles.
+// Face corners may be v, v/vt, v//vn or v/vt/vn and negative (relative) indices are resolved.
+bool parseOBJ(const char* file, std::vector<glm::vec3> &vertex_data, std::vector<glm::uvec3> &face_data) {
   std::ifstream ifs(file);
-  std::stringstream ss;
+  if (!ifs) {
+    console::error("failed to open ", file);
+    return false;
+  }
   std::string line;
-  std::regex v ("v ([-]?[0-9.]*) ([-]?[0-9.]*) ([-]?[0-9.]*)");
-  std::regex f ("f ([0-9]*) ([0-9]*) ([0-9]*)");
-  std::smatch sm;
-  std::vector<glm::vec3> vertex_data;
-  std::vector<glm::uvec3> face_data;
-  getline(ifs, line); // consume top line
-  while(getline(ifs, line)) {
-    if (std::regex_match(line, sm, v))
-      vertex_data.push_back(glm::vec3(std::stof(sm[1]), std::stof(sm[2]), std::stof(sm[3])));
-    else if (std::regex_match(line, sm, f))
-      face_data.push_back(glm::uvec3(std::stoi(sm[1]), std::stoi(sm[2]), std::stoi(sm[3])));
+  std::vector<long> polygon;
+  size_t skipped = 0;
+  while (getline(ifs, line)) {
+    char *c = &line[0], *end;
+    if (line.size() < 2 || !std::isspace((unsigned char)c[1]))
+      continue;
+    if (c[0] == 'v') {
+      glm::vec3 v;
+      v.x = std::strtof(c+1, &end);
+      v.y = std::strtof(end, &end);
+      v.z = std::strtof(end, &end);
+      vertex_data.push_back(v);
+    }
+    else if (c[0] == 'f') {
+      polygon.clear();
+      bool valid = true;
+      for (c += 1;;) {
+        long index = std::strtol(c, &end, 10);
+        if (end == c)
+          break;
+        index = (index < 0) ? long(vertex_data.size()) + index : index - 1;
+        valid = valid && index >= 0 && index < long(vertex_data.size());
+        polygon.push_back(index);
+        for (c = end; *c && !std::isspace((unsigned char)*c); ++c); // skip /vt/vn
+      }
+      if (!valid || polygon.size() < 3) {
+        skipped++;
+        continue;
+      }
+      for (size_t k = 2; k < polygon.size(); ++k)
+        face_data.push_back(glm::uvec3(polygon[0], polygon[k-1], polygon[k]));
+    }
   }
-  console::log("vertex data size: ", vertex_data.size());
-  console::log("face data size: ", face_data.size());
+  console::log(file, ": ", vertex_data.size(), " vertices, ", face_data.size(), " triangles");
+  if (skipped)
+    console::error(file, ": skipped ", skipped, " malformed faces");
+  return true;
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include "batch.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+
+static bool parse_vec3(const std::string &value, glm::vec3 &v)
+{
+  return std::sscanf(value.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+std::vector<Batch_Job> read_manifest(const char *path, const Batch_Job &defaults)
+{
+  std::vector<Batch_Job> jobs;
+  std::ifstream file(path);
+  if (!file) {
+    console::error("can't open batch manifest ", path);
+    return jobs; }
+  std::string line;
+  for (int number = 1; std::getline(file, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    Batch_Job job = defaults;
+    if (!(fields >> job.scene))
+      continue;
+    if (!(fields >> job.output)) {
+      console::error(path, ':', number, ": expected a scene and an output file");
+      continue; }
+    bool valid = true;
+    for (std::string field; fields >> field;) {
+      std::size_t eq = field.find('=');
+      std::string key = field.substr(0, eq), value = eq == std::string::npos ? "" : field.substr(eq + 1);
+      if (key == "eye")
+        valid &= parse_vec3(value, job.eye);
+      else if (key == "target")
+        valid &= parse_vec3(value, job.target);
+      else if (key == "fov")
+        valid &= std::sscanf(value.c_str(), "%f", &job.fov) == 1;
+      else if (key == "samples")
+        valid &= std::sscanf(value.c_str(), "%u", &job.samples) == 1 && job.samples > 0;
+      else
+        valid = false; }
+    if (!valid) {
+      console::error(path, ':', number, ": can't read the job, skipped");
+      continue; }
+    jobs.push_back(job); }
+  return jobs;
+}
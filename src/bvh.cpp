@@ -0,0 +1,125 @@
+#include "bvh.h"
+
+
+
+void AABB::grow(glm::vec3 p)
+{
+  lo = glm::min(lo, p);
+  hi = glm::max(hi, p);
+}
+
+void AABB::grow(const AABB &b)
+{
+  lo = glm::min(lo, b.lo);
+  hi = glm::max(hi, b.hi);
+}
+
+glm::vec3 AABB::centroid() const
+{
+  return 0.5f * (lo + hi);
+}
+
+float AABB::area() const
+{
+  glm::vec3 e = hi - lo;
+  return (e.x < 0.0f) ? 0.0f : 2.0f * (e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+
+
+#define SAH_BINS 16
+#define MAX_LEAF_SIZE 4
+#define MAX_DEPTH 30 // keeps every path within the 32-entry traversal stack in the shader
+
+struct BVH_Builder
+{
+  const std::vector<AABB> &bounds;
+  std::vector<BVH_Node> &nodes;
+  std::vector<int> &order;
+
+  void build(int, int, int);
+};
+
+#include <algorithm>
+void BVH_Builder::build(int first, int count, int depth)
+{
+  int node_index = nodes.size();
+  nodes.push_back(BVH_Node());
+  AABB box, centroid_box;
+  for (int i = first; i < first + count; ++i) {
+    box.grow(bounds[order[i]]);
+    centroid_box.grow(bounds[order[i]].centroid()); }
+  nodes[node_index].lo = box.lo;
+  nodes[node_index].hi = box.hi;
+  auto make_leaf = [&]() {
+    nodes[node_index].offset = first;
+    nodes[node_index].count = count; };
+  if (count <= 1 || depth >= MAX_DEPTH)
+    return make_leaf();
+  // pick the cheapest bin boundary over all three axes
+  int best_axis = -1, best_split = 0;
+  float best_cost = float(count) * box.area();
+  glm::vec3 extent = centroid_box.hi - centroid_box.lo;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (extent[axis] <= 0.0f)
+      continue;
+    AABB bin_box[SAH_BINS];
+    int bin_count[SAH_BINS] = { 0 };
+    float scale = SAH_BINS / extent[axis];
+    for (int i = first; i < first + count; ++i) {
+      int b = std::min(SAH_BINS - 1, int((bounds[order[i]].centroid()[axis] - centroid_box.lo[axis]) * scale));
+      bin_box[b].grow(bounds[order[i]]);
+      bin_count[b] += 1; }
+    float right_area[SAH_BINS];
+    int right_count[SAH_BINS];
+    AABB sweep;
+    int n = 0;
+    for (int b = SAH_BINS - 1; b > 0; --b) {
+      sweep.grow(bin_box[b]);
+      n += bin_count[b];
+      right_area[b] = sweep.area();
+      right_count[b] = n; }
+    sweep = AABB();
+    n = 0;
+    for (int b = 0; b < SAH_BINS - 1; ++b) {
+      sweep.grow(bin_box[b]);
+      n += bin_count[b];
+      float cost = n * sweep.area() + right_count[b+1] * right_area[b+1];
+      if (n > 0 && right_count[b+1] > 0 && cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b + 1; } }
+  }
+  int mid;
+  if (best_axis != -1) {
+    float scale = SAH_BINS / extent[best_axis];
+    auto in_left = [&](int p) {
+      return std::min(SAH_BINS - 1, int((bounds[p].centroid()[best_axis] - centroid_box.lo[best_axis]) * scale)) < best_split; };
+    mid = std::partition(order.begin() + first, order.begin() + first + count, in_left) - order.begin();
+  }
+  else if (count > MAX_LEAF_SIZE) {
+    // no split beats a leaf but the leaf would be too large, fall back to a median split
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+    mid = first + count / 2;
+    std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count,
+      [&](int a, int b) { return bounds[a].centroid()[axis] < bounds[b].centroid()[axis]; });
+  }
+  else
+    return make_leaf();
+  build(first, mid - first, depth + 1);
+  nodes[node_index].offset = nodes.size();
+  nodes[node_index].count = 0;
+  build(mid, first + count - mid, depth + 1);
+}
+
+#include <numeric>
+void build_BVH(const std::vector<AABB> &bounds, std::vector<BVH_Node> &nodes, std::vector<int> &order)
+{
+  nodes.clear();
+  order.resize(bounds.size());
+  std::iota(order.begin(), order.end(), 0);
+  if (bounds.empty())
+    return;
+  nodes.reserve(2 * bounds.size());
+  BVH_Builder { bounds, nodes, order }.build(0, bounds.size(), 0);
+}
@@ -0,0 +1,152 @@
+#include "capture.h"
+#include <vector>
+#ifdef __linux__
+#include <csignal>
+#endif
+
+
+bool Frame_Stream::open(const std::string &file, int w, int h, int fps, bool wait_for_consumer)
+{
+#ifdef __linux__
+  std::signal(SIGPIPE, SIG_IGN); // a consumer that goes away fails the write instead of killing us
+#endif
+  out = std::fopen(file.c_str(), "wb"); // a named pipe blocks here until the consumer opens it
+  if (!out) {
+    console::error("can't open ", file, " for capture");
+    return false; }
+  path = file;
+  y4m = file.size() > 4 && file.compare(file.size() - 4, 4, ".y4m") == 0;
+  block = wait_for_consumer;
+  width = w;
+  height = h;
+  frames = dropped = 0;
+  failed = std::make_shared<std::atomic<bool>>(false);
+  if (y4m)
+    std::fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+  GLsizeiptr bytes = 4 * GLsizeiptr(width) * height;
+  GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  for (Slot &s : slot) {
+    glCreateBuffers(1, &s.pbo);
+    glNamedBufferStorage(s.pbo, bytes, nullptr, flags);
+    s.pixels = (const GLubyte*)glMapNamedBufferRange(s.pbo, 0, bytes, flags); }
+  next = 0;
+  writer.start(1, CAPTURE_SLOTS); // one thread keeps the frames in order
+  console::log("capturing ", y4m ? "y4m" : "raw rgb24", ' ', width, 'x', height, " to ", path);
+  return true;
+}
+
+bool Frame_Stream::busy(const Slot &s) const
+{
+  return s.fence || (s.written && !*s.written);
+}
+
+bool Frame_Stream::in_flight() const
+{
+  for (const Slot &s : slot)
+    if (busy(s))
+      return true;
+  return false;
+}
+
+// Passes a copied frame to the writer, which converts it while the render loop carries on
+bool Frame_Stream::submit(Slot &s)
+{
+  auto written = std::make_shared<std::atomic<bool>>(false);
+  auto error = failed;
+  const GLubyte *pixels = s.pixels;
+  std::FILE *file = out;
+  int w = width, h = height;
+  bool yuv = y4m;
+  bool queued = writer.try_submit([=]() {
+    std::size_t count = std::size_t(w) * h;
+    std::vector<GLubyte> frame(3 * count);
+    if (yuv) {
+      for (std::size_t i = 0; i < count; ++i) {
+        float r = pixels[4*i], g = pixels[4*i+1], b = pixels[4*i+2];
+        frame[i]           = GLubyte( 16.5f + 0.257f*r + 0.504f*g + 0.098f*b);
+        frame[count + i]   = GLubyte(128.5f - 0.148f*r - 0.291f*g + 0.439f*b);
+        frame[2*count + i] = GLubyte(128.5f + 0.439f*r - 0.368f*g - 0.071f*b); }
+      std::fputs("FRAME\n", file); }
+    else
+      for (std::size_t i = 0; i < count; ++i)
+        for (int c = 0; c < 3; ++c)
+          frame[3*i + c] = pixels[4*i + c];
+    if (!*error && std::fwrite(frame.data(), 1, frame.size(), file) != frame.size())
+      *error = true;
+    *written = true; });
+  if (!queued)
+    return false;
+  glDeleteSync(s.fence);
+  s.fence = 0;
+  s.written = written;
+  return true;
+}
+
+// Frames go to the writer in the order they were copied, so the first copy still in flight holds
+// back the ones after it
+void Frame_Stream::poll()
+{
+  if (!out)
+    return;
+  for (unsigned i = 0; i < CAPTURE_SLOTS; ++i) {
+    Slot &s = slot[(next + i) % CAPTURE_SLOTS];
+    if (!s.fence)
+      continue;
+    if (glClientWaitSync(s.fence, 0, 0) == GL_TIMEOUT_EXPIRED || !submit(s))
+      break; }
+  if (*failed) {
+    console::error("capture to ", path, " failed, the consumer may have closed it");
+    close(); }
+}
+
+void Frame_Stream::capture(GLuint texture, int w, int h)
+{
+  if (!out)
+    return;
+  if (w != width || h != height) {
+    console::error("capture stopped: the render resolution changed to ", w, 'x', h);
+    close();
+    return; }
+  poll();
+  if (!out)
+    return;
+  Slot &s = slot[next];
+  if (busy(s) && !block) {
+    dropped++;
+    return; }
+  if (s.fence) {
+    glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    poll(); }
+  while (busy(s))
+    std::this_thread::yield();
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+  glGetTextureImage(texture, 0, GL_RGBA, GL_UNSIGNED_BYTE, 4 * GLsizei(width) * height, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  s.written.reset();
+  next = (next + 1) % CAPTURE_SLOTS;
+  frames++;
+}
+
+// Writes out the frames in flight before closing
+void Frame_Stream::close()
+{
+  if (!out)
+    return;
+  for (Slot &s : slot)
+    if (s.fence)
+      glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+  for (unsigned i = 0; i < CAPTURE_SLOTS; ++i) {
+    Slot &s = slot[(next + i) % CAPTURE_SLOTS];
+    while (s.fence && !submit(s))
+      std::this_thread::yield(); }
+  writer.stop();
+  std::fclose(out);
+  out = nullptr;
+  for (Slot &s : slot) {
+    glUnmapNamedBuffer(s.pbo);
+    glDeleteBuffers(1, &s.pbo);
+    s = Slot(); }
+  console::log("captured ", frames, " frames to ", path, ", dropped ", dropped);
+}
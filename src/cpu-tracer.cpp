@@ -0,0 +1,635 @@
+#include "cpu-tracer.h"
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+void Tile_Scheduler::start(unsigned thread_count)
+{
+  queues.reset(new Queue[thread_count]);
+  stopping = false;
+  for (unsigned i = 0; i < thread_count; ++i)
+    threads.emplace_back(&Tile_Scheduler::run, this, i);
+}
+
+bool Tile_Scheduler::next_tile(unsigned worker, unsigned &tile)
+{
+  {
+    Queue &own = queues[worker];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tiles.empty()) {
+      tile = own.tiles.front();
+      own.tiles.pop_front();
+      return true; }
+  }
+  for (std::size_t i = 1; i < threads.size(); ++i) {
+    Queue &victim = queues[(worker + i) % threads.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tiles.empty()) {
+      tile = victim.tiles.back();
+      victim.tiles.pop_back();
+      return true; }
+  }
+  return false;
+}
+
+void Tile_Scheduler::run(unsigned worker)
+{
+  unsigned seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&]() { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+    for (unsigned tile; next_tile(worker, tile);)
+      job(tile);
+    std::lock_guard<std::mutex> guard(lock);
+    if (--busy == 0)
+      done.notify_one();
+  }
+}
+
+void Tile_Scheduler::dispatch(const std::vector<unsigned> &tiles, std::function<void(unsigned)> work)
+{
+  std::size_t n = threads.size();
+  for (std::size_t i = 0; i < n; ++i) {
+    std::lock_guard<std::mutex> guard(queues[i].lock);
+    queues[i].tiles.assign(tiles.begin() + tiles.size() * i / n, tiles.begin() + tiles.size() * (i + 1) / n); }
+  std::unique_lock<std::mutex> guard(lock);
+  job = std::move(work);
+  busy = unsigned(n);
+  generation++;
+  wake.notify_all();
+  done.wait(guard, [this]() { return busy == 0; });
+}
+
+void Tile_Scheduler::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &t : threads)
+    t.join();
+  threads.clear();
+}
+
+
+
+// The rest follows ray-compute.glsl function by function, names in this file's style
+namespace
+{
+using glm::vec3;
+using glm::vec4;
+using glm::ivec2;
+
+const float pi = 3.14159f;
+const float tmin = 0.05f;
+const float tmax = 1e20f;
+const int bvh_stack_size = 32;
+const vec3 ambient = vec3(0.05f);
+
+struct Ray { vec3 o, d; };
+struct Isect { float t; vec3 position, normal; int material; };
+struct Light { vec3 position, color, direction; };
+struct Sampler { uint32_t index, seed, stream; };
+struct Sheared_Ray { vec3 o; int kx, ky, kz; vec3 S; };
+
+const Isect miss = { -1.0f, vec3(0), vec3(0), -1 };
+
+const uint32_t dim_pixel = 0u;
+const uint32_t dims_per_bounce = 3u;
+uint32_t bounce_dimension(int bounce, uint32_t k) { return 2u + uint32_t(bounce) * dims_per_bounce + k; }
+
+uint32_t hash(uint32_t x)
+{
+  x += (x << 10u);
+  x ^= (x >> 6u);
+  x += (x << 3u);
+  x ^= (x >> 11u);
+  x += (x << 15u);
+  return x;
+}
+uint32_t hash(uint32_t x, uint32_t y, uint32_t z) { return hash(x ^ hash(y) ^ hash(z)); }
+
+uint32_t pcg(uint32_t state)
+{
+  uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+uint32_t bit_reverse(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+  x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+  x = bit_reverse(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return bit_reverse(x);
+}
+
+float to_unit_float(uint32_t x) { return float(x >> 8) * (1.0f / 16777216.0f); }
+
+uint32_t morton(uint32_t x, uint32_t y)
+{
+  auto spread = [](uint32_t v) {
+    v &= 0xFFFFu;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    return (v | (v << 1)) & 0x55555555u; };
+  return spread(x) | (spread(y) << 1);
+}
+
+struct Path_Tracer
+{
+  const CPU_Frame &frame;
+  const Scene_Interpreter &scene;
+  const std::vector<uint32_t> &sobol_table;
+  std::vector<uint32_t> &pcg_state;
+
+  ivec2 mbuf(int i) const { return ivec2(scene.mbuf[2*i], scene.mbuf[2*i+1]); }
+  ivec2 lbuf(int i) const { return ivec2(scene.lbuf[2*i], scene.lbuf[2*i+1]); }
+  const int *gbuf(int i) const { return &scene.gbuf[4*i]; }
+  vec3 heap3(int i) const { return vec3(scene.heap[i], scene.heap[i+1], scene.heap[i+2]); }
+
+  uint32_t sobol(uint32_t index, uint32_t dim) const
+  {
+    uint32_t x = 0u;
+    for (int bit = 0; index != 0u; bit++, index >>= 1)
+      if (index & 1u)
+        x ^= sobol_table[dim * SOBOL_BITS + bit];
+    return x;
+  }
+
+  Sampler begin_sample(ivec2 pixel)
+  {
+    uint32_t &state = pcg_state[pixel.y * frame.resolution.x + pixel.x];
+    state = state * 747796405u + 2891336453u;
+    uint32_t scramble = hash(uint32_t(pixel.x), uint32_t(pixel.y), 0x5eedu + (frame.seed - frame.index));
+    return Sampler{ frame.index, scramble, pcg(state) };
+  }
+
+  float sample_1D(const Sampler &s, uint32_t dim) const
+  {
+    if (dim >= uint32_t(SOBOL_DIMS))
+      return to_unit_float(pcg(s.stream + dim * 0x9e3779b9u));
+    uint32_t index = owen_scramble(s.index, s.seed);
+    return to_unit_float(owen_scramble(sobol(index, dim), hash(s.seed ^ dim)));
+  }
+
+  glm::vec2 sample_2D(const Sampler &s, uint32_t dim) const { return glm::vec2(sample_1D(s, dim), sample_1D(s, dim + 1u)); }
+
+  static float slabs(const BVH_Node &node, const Ray &ray, vec3 inv_dir, float current_tmax)
+  {
+    vec3 t0 = (node.lo - ray.o) * inv_dir;
+    vec3 t1 = (node.hi - ray.o) * inv_dir;
+    vec3 tn = glm::min(t0, t1), tf = glm::max(t0, t1);
+    float tnear = std::max(std::max(tn.x, tn.y), std::max(tn.z, 0.0f));
+    float tfar = std::min(std::min(tf.x, tf.y), tf.z);
+    return (tnear <= tfar && tnear < current_tmax) ? tnear : tmax;
+  }
+
+  Isect intersect_plane(const int *g, const Ray &ray, float current_tmax) const
+  {
+    vec4 plane_eq = scene.plane_table[g[1]];
+    vec3 n = vec3(plane_eq);
+    float denom = glm::dot(ray.d, n);
+    if (denom != 0) {
+      float t = (plane_eq.w - glm::dot(ray.o, n)) / denom;
+      if (t > tmin && t < current_tmax)
+        return Isect{ t, ray.o + ray.d*t, n, g[2] };
+    }
+    return miss;
+  }
+
+  Isect intersect_sphere(const int *g, const Ray &ray, float current_tmax) const
+  {
+    vec4 sphere_eq = scene.sphere_table[g[1]];
+    vec3 c = vec3(sphere_eq);
+    float t = -1.0f;
+    float B = 2 * glm::dot(ray.o - c, ray.d);
+    float C = glm::dot(ray.o - c, ray.o - c) - sphere_eq.w;
+    float D = B*B - 4 * C;
+    if (D >= -tmin) {
+      float sol = (-B - std::sqrt(D)) / 2.0f;
+      if (sol >= tmin && sol <= current_tmax)
+        t = sol;
+      else {
+        sol = (-B + std::sqrt(D)) / 2.0f;
+        if (sol >= tmin && sol <= current_tmax)
+          t = sol;
+      }
+    }
+    if (t != -1.0f)
+      return Isect{ t, ray.o + ray.d*t, glm::normalize((ray.o + ray.d*t) - c), g[2] };
+    return miss;
+  }
+
+  bool occludes_plane(const int *g, const Ray &ray, float max_t) const
+  {
+    vec4 plane_eq = scene.plane_table[g[1]];
+    float denom = glm::dot(ray.d, vec3(plane_eq));
+    float t = (plane_eq.w - glm::dot(ray.o, vec3(plane_eq))) / denom;
+    return denom != 0 && t > tmin && t < max_t;
+  }
+
+  bool occludes_sphere(const int *g, const Ray &ray, float max_t) const
+  {
+    vec4 sphere_eq = scene.sphere_table[g[1]];
+    vec3 oc = ray.o - vec3(sphere_eq);
+    float b = glm::dot(oc, ray.d);
+    float D = b*b - glm::dot(oc, oc) + sphere_eq.w;
+    if (D < 0)
+      return false;
+    float sqrt_D = std::sqrt(D);
+    float t0 = -b - sqrt_D, t1 = -b + sqrt_D;
+    return (t0 > tmin && t0 < max_t) || (t1 > tmin && t1 < max_t);
+  }
+
+  Ray mesh_ray(const int *g, const Ray &ray) const
+  {
+    vec4 placement = scene.mesh_table[g[1]];
+    return Ray{ (ray.o - vec3(placement)) / placement.w, ray.d };
+  }
+
+  static Sheared_Ray shear(const Ray &ray)
+  {
+    vec3 ad = glm::abs(ray.d);
+    int kz = (ad.x > ad.y) ? ((ad.x > ad.z) ? 0 : 2) : ((ad.y > ad.z) ? 1 : 2);
+    int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+    if (ray.d[kz] < 0.0f)
+      std::swap(kx, ky);
+    return Sheared_Ray{ ray.o, kx, ky, kz, vec3(ray.d[kx], ray.d[ky], 1.0f) / ray.d[kz] };
+  }
+
+  float intersect_triangle(const Sheared_Ray &r, glm::uvec4 face, float t_lo, float t_hi) const
+  {
+    vec3 A = vec3(scene.mesh_vertices[face.x]) - r.o;
+    vec3 B = vec3(scene.mesh_vertices[face.y]) - r.o;
+    vec3 C = vec3(scene.mesh_vertices[face.z]) - r.o;
+    float Ax = A[r.kx] - r.S.x*A[r.kz], Ay = A[r.ky] - r.S.y*A[r.kz];
+    float Bx = B[r.kx] - r.S.x*B[r.kz], By = B[r.ky] - r.S.y*B[r.kz];
+    float Cx = C[r.kx] - r.S.x*C[r.kz], Cy = C[r.ky] - r.S.y*C[r.kz];
+    float U = Cx*By - Cy*Bx;
+    float V = Ax*Cy - Ay*Cx;
+    float W = Bx*Ay - By*Ax;
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+      return -1.0f;
+    float det = U + V + W;
+    if (det == 0.0f)
+      return -1.0f;
+    float t = r.S.z*(U*A[r.kz] + V*B[r.kz] + W*C[r.kz]) / det;
+    return (t > t_lo && t < t_hi) ? t : -1.0f;
+  }
+
+  Isect intersect_mesh(const int *g, const Ray &ray, float current_tmax) const
+  {
+    const std::vector<BVH_Node> &nodes = scene.mesh_bvh;
+    float scale = scene.mesh_table[g[1]].w;
+    Ray local = mesh_ray(g, ray);
+    Sheared_Ray sheared = shear(local);
+    vec3 inv_dir = 1.0f / local.d;
+    float t_lo = tmin / scale, t_hi = current_tmax / scale;
+    int hit_face = -1;
+    int stack[bvh_stack_size];
+    int sp = 0;
+    int node = g[3];
+    if (slabs(nodes[node], local, inv_dir, t_hi) == tmax)
+      return miss;
+    while (true) {
+      if (nodes[node].count > 0) {
+        for (int f = nodes[node].offset; f < nodes[node].offset + nodes[node].count; f++) {
+          float t = intersect_triangle(sheared, scene.mesh_faces[f], t_lo, t_hi);
+          if (t > 0) {
+            t_hi = t;
+            hit_face = f; }
+        }
+      }
+      else {
+        int closer = node + 1, further = nodes[node].offset;
+        float t_closer = slabs(nodes[closer], local, inv_dir, t_hi);
+        float t_further = slabs(nodes[further], local, inv_dir, t_hi);
+        if (t_further < t_closer) {
+          std::swap(closer, further);
+          std::swap(t_closer, t_further); }
+        if (t_closer < tmax) {
+          if (t_further < tmax && sp < bvh_stack_size)
+            stack[sp++] = further;
+          node = closer;
+          continue; }
+      }
+      if (sp == 0)
+        break;
+      node = stack[--sp];
+    }
+    if (hit_face == -1)
+      return miss;
+    glm::uvec4 f = scene.mesh_faces[hit_face];
+    vec3 a = vec3(scene.mesh_vertices[f.x]);
+    vec3 n = glm::normalize(glm::cross(vec3(scene.mesh_vertices[f.y]) - a, vec3(scene.mesh_vertices[f.z]) - a));
+    float t = t_hi * scale;
+    return Isect{ t, ray.o + ray.d*t, n, g[2] };
+  }
+
+  bool occludes_mesh(const int *g, const Ray &ray, float max_t) const
+  {
+    const std::vector<BVH_Node> &nodes = scene.mesh_bvh;
+    float scale = scene.mesh_table[g[1]].w;
+    Ray local = mesh_ray(g, ray);
+    Sheared_Ray sheared = shear(local);
+    vec3 inv_dir = 1.0f / local.d;
+    float t_lo = tmin / scale, t_hi = max_t / scale;
+    int stack[bvh_stack_size];
+    int sp = 0;
+    stack[sp++] = g[3];
+    while (sp > 0) {
+      int node = stack[--sp];
+      if (slabs(nodes[node], local, inv_dir, t_hi) == tmax)
+        continue;
+      if (nodes[node].count > 0) {
+        for (int f = nodes[node].offset; f < nodes[node].offset + nodes[node].count; f++)
+          if (intersect_triangle(sheared, scene.mesh_faces[f], t_lo, t_hi) > 0)
+            return true;
+      }
+      else if (sp + 2 <= bvh_stack_size) {
+        stack[sp++] = nodes[node].offset;
+        stack[sp++] = node + 1; }
+    }
+    return false;
+  }
+
+  bool check_occlusion(const Ray &ray, int i, float max_t) const
+  {
+    const int *g = gbuf(i);
+    switch (g[0]) {
+      case 0: return occludes_plane(g, ray, max_t);
+      case 1: return occludes_sphere(g, ray, max_t);
+      case 2: return occludes_mesh(g, ray, max_t);
+      default: break;
+    }
+    return false;
+  }
+
+  Isect check_isect(const Ray &ray, int i, float current_tmax) const
+  {
+    const int *g = gbuf(i);
+    switch (g[0]) {
+      case 0: return intersect_plane(g, ray, current_tmax);
+      case 1: return intersect_sphere(g, ray, current_tmax);
+      case 2: return intersect_mesh(g, ray, current_tmax);
+      default: break;
+    }
+    return miss;
+  }
+
+  Isect cast_ray(const Ray &ray) const
+  {
+    int num_shapes = int(scene.geometry.size()), num_bounded = scene.num_bounded;
+    const std::vector<BVH_Node> &bvh = scene.bvh;
+    float current_min_t = tmax;
+    Isect result = miss;
+    for (int i = num_bounded; i < num_shapes; i++) {
+      Isect hit = check_isect(ray, i, current_min_t);
+      if (hit.t > 0) {
+        current_min_t = hit.t;
+        result = hit; }
+    }
+    vec3 inv_dir = 1.0f / ray.d;
+    if (num_bounded == 0 || slabs(bvh[0], ray, inv_dir, current_min_t) == tmax)
+      return result;
+    int stack[bvh_stack_size];
+    int sp = 0;
+    int node = 0;
+    while (true) {
+      if (bvh[node].count > 0) {
+        for (int i = bvh[node].offset; i < bvh[node].offset + bvh[node].count; i++) {
+          Isect hit = check_isect(ray, i, current_min_t);
+          if (hit.t > 0) {
+            current_min_t = hit.t;
+            result = hit; }
+        }
+      }
+      else {
+        int closer = node + 1, further = bvh[node].offset;
+        float t_closer = slabs(bvh[closer], ray, inv_dir, current_min_t);
+        float t_further = slabs(bvh[further], ray, inv_dir, current_min_t);
+        if (t_further < t_closer) {
+          std::swap(closer, further);
+          std::swap(t_closer, t_further); }
+        if (t_closer < tmax) {
+          if (t_further < tmax && sp < bvh_stack_size)
+            stack[sp++] = further;
+          node = closer;
+          continue; }
+      }
+      if (sp == 0)
+        break;
+      node = stack[--sp];
+    }
+    return result;
+  }
+
+  bool occluded(const Ray &ray, float max_t) const
+  {
+    int num_shapes = int(scene.geometry.size()), num_bounded = scene.num_bounded;
+    const std::vector<BVH_Node> &bvh = scene.bvh;
+    for (int i = num_bounded; i < num_shapes; i++)
+      if (check_occlusion(ray, i, max_t))
+        return true;
+    if (num_bounded == 0)
+      return false;
+    vec3 inv_dir = 1.0f / ray.d;
+    int stack[bvh_stack_size];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+      int node = stack[--sp];
+      if (slabs(bvh[node], ray, inv_dir, max_t) == tmax)
+        continue;
+      if (bvh[node].count > 0) {
+        for (int i = bvh[node].offset; i < bvh[node].offset + bvh[node].count; i++)
+          if (check_occlusion(ray, i, max_t))
+            return true;
+      }
+      else if (sp + 2 <= bvh_stack_size) {
+        stack[sp++] = bvh[node].offset;
+        stack[sp++] = node + 1; }
+    }
+    return false;
+  }
+
+  Light light_sample(int i, vec3 sp) const
+  {
+    ivec2 l = lbuf(i);
+    const Light_Record &record = scene.light_table[l.y];
+    switch (l.x) {
+      case 0: // directional
+        return Light{ vec3(std::numeric_limits<float>::infinity(), 0.0f, 0.0f), vec3(record.color), vec3(record.direction) };
+      case 1: { // point
+        vec3 lp = vec3(record.position);
+        vec3 ld = lp - sp;
+        return Light{ lp, record.params.y * vec3(record.color) / glm::dot(ld, ld), glm::normalize(ld) }; }
+      case 2: { // spot
+        vec3 lp = vec3(record.position);
+        vec3 lc = vec3(record.color);
+        const float le = 50.0f;
+        vec3 light_to_point = sp - lp;
+        float cos_ld = glm::dot(glm::normalize(light_to_point), vec3(record.direction));
+        if (cos_ld > record.params.x)
+          lc *= record.params.y / glm::dot(light_to_point, light_to_point) * std::pow(cos_ld, le);
+        else
+          lc = ambient;
+        return Light{ lp, lc, glm::normalize(light_to_point) }; }
+      default: break;
+    }
+    return Light{ vec3(0), vec3(0), vec3(0) };
+  }
+
+  vec3 reflectance(const Ray &ray, const Isect &isect, ivec2 m, const Light &light, vec3 l) const
+  {
+    vec3 n = isect.normal;
+    vec3 r = glm::reflect(l, n);
+    vec3 diffuse = heap3(m.y+3) * std::max(glm::dot(n, l), 0.0f);
+    vec3 specular = m.x == 1 ? heap3(m.y+6) * std::pow(std::max(glm::dot(r, ray.d), 0.0f), scene.heap[m.y+9]) : vec3(0);
+    return light.color * (specular + diffuse);
+  }
+
+  vec3 shading(const Ray &ray, const Isect &isect) const
+  {
+    vec3 color = vec3(0);
+    ivec2 m = mbuf(isect.material);
+    for (int li = 0; li < int(scene.light.size()); li++) {
+      Light light = light_sample(li, isect.position);
+      vec3 point_to_light = light.position - isect.position;
+      vec3 l = glm::normalize(point_to_light);
+      if (occluded(Ray{ isect.position, l }, glm::length(point_to_light)))
+        continue;
+      color += reflectance(ray, isect, m, light, l);
+    }
+    return ambient * heap3(m.y) + color;
+  }
+
+  static vec3 sample_hemisphere(vec3 n, float r1, float r2)
+  {
+    vec3 nt = std::abs(n.x) > std::abs(n.y) ? vec3(n.z, 0, -n.x) / std::sqrt(n.x*n.x + n.z*n.z)
+                                             : vec3(0, -n.z, n.y) / std::sqrt(n.y*n.y + n.z*n.z);
+    vec3 nb = glm::cross(n, nt);
+    float sin_theta = std::sqrt(1.0f - r1*r1);
+    float phi = 2.0f * pi * r2;
+    vec3 s = vec3(sin_theta * std::cos(phi), r1, sin_theta * std::sin(phi));
+    return s.x * nb + s.y * n + s.z * nt;
+  }
+
+  vec3 indirect_diffuse(const Sampler &s, int bounce, const Isect &isect) const
+  {
+    glm::vec2 r = sample_2D(s, bounce_dimension(bounce, 0u));
+    vec3 sample_world = sample_hemisphere(isect.normal, r.x, r.y);
+    Ray sample_ray = Ray{ isect.position + sample_world, sample_world };
+    Isect tsect = cast_ray(sample_ray);
+    if (tsect.t > 0) {
+      ivec2 mi = mbuf(tsect.material);
+      if (mi.x == 0 || mi.x == 1)
+        return r.x * shading(sample_ray, tsect);
+    }
+    return vec3(0);
+  }
+
+  Ray primary_ray(ivec2 pixel, const Sampler &s) const
+  {
+    glm::vec2 jitter = frame.accumulate ? sample_2D(s, dim_pixel) : glm::vec2(0);
+    float x = (float(pixel.x) + jitter.x) / float(frame.resolution.x);
+    float y = (float(frame.resolution.y - 1 - pixel.y) + jitter.y) / float(frame.resolution.y);
+    return Ray{ frame.eye, glm::normalize((frame.corner + frame.across*x + frame.up*y) - frame.eye) };
+  }
+
+  // main() of the megakernel up to storePixel, only the current and the previous bounce are kept
+  vec3 trace_pixel(ivec2 pixel)
+  {
+    Sampler s = begin_sample(pixel);
+    Ray ray = primary_ray(pixel, s);
+    vec3 pixel_color = vec3(0);
+    ivec2 previous = ivec2(-1);
+    for (int i = 0; i < frame.max_depth; i++) {
+      Isect isect = cast_ray(ray);
+      if (isect.t <= 0)
+        break;
+      ivec2 m = mbuf(isect.material);
+      if (m.x == 0 || m.x == 1) {
+        if (i > 0 && (previous.x == 2 || previous.x == 3))
+          pixel_color += heap3(previous.y) * shading(ray, isect);
+        else {
+          pixel_color += shading(ray, isect);
+          if (frame.accumulate)
+            pixel_color += indirect_diffuse(s, i, isect);
+        }
+        break;
+      }
+      if (m.x == 2)
+        ray = Ray{ isect.position, glm::reflect(ray.d, isect.normal) };
+      if (m.x == 3)
+        ray = Ray{ isect.position, glm::refract(-ray.d, isect.normal, scene.heap[m.y+3]) };
+      previous = m;
+    }
+    return glm::clamp(pixel_color, 0.0f, 1.0f);
+  }
+};
+}
+
+
+void CPU_Tracer::start(unsigned thread_count)
+{
+  sobol = sobol_direction_numbers();
+  scheduler.start(std::max(thread_count, 1u));
+}
+
+void CPU_Tracer::trace(const CPU_Frame &frame)
+{
+  if (frame.resolution != size) {
+    size = frame.resolution;
+    image.assign(std::size_t(size.x) * size.y, vec4(0, 0, 0, 1));
+    accum.assign(image.size(), vec4(0));
+    pcg_state = pcg_seeds(image.size());
+    glm::ivec2 tiles = (size + CPU_TILE - 1) / CPU_TILE;
+    order.resize(std::size_t(tiles.x) * tiles.y);
+    for (unsigned t = 0; t < order.size(); ++t)
+      order[t] = t;
+    std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+      return morton(a % tiles.x, a / tiles.x) < morton(b % tiles.x, b / tiles.x); }); }
+  int tiles_x = (size.x + CPU_TILE - 1) / CPU_TILE;
+  scheduler.dispatch(order, [&](unsigned tile) {
+    Path_Tracer tracer{ frame, *frame.scene, sobol, pcg_state };
+    ivec2 origin = ivec2(tile % tiles_x, tile / tiles_x) * CPU_TILE;
+    ivec2 end = glm::min(origin + CPU_TILE, size);
+    for (int y = origin.y; y < end.y; ++y)
+      for (int x = origin.x; x < end.x; ++x) {
+        std::size_t p = std::size_t(y) * size.x + x;
+        vec3 color = tracer.trace_pixel(ivec2(x, y));
+        if (frame.accumulate) { // storePixel
+          vec4 history = frame.index == 0u ? vec4(0) : accum[p];
+          float n = history.w + 1.0f;
+          vec3 mean = vec3(history) + (color - vec3(history)) / n;
+          accum[p] = vec4(mean, n);
+          color = mean; }
+        image[p] = vec4(color, 1.0f); } });
+}
+
+void CPU_Tracer::stop()
+{
+  scheduler.stop();
+}
@@ -0,0 +1,118 @@
+#include "farm.h"
+#include "ray-tracer-app.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+
+static_assert(std::atomic<unsigned>::is_always_lock_free, "the tile flags are shared between processes");
+
+Farm_Frame *farm = nullptr;
+unsigned farm_worker = 0;
+
+static const char *farm_option(int argc, char **argv, const char *name)
+{
+  for (int i = 2; i < argc - 1; ++i)
+    if (std::string(argv[i]) == name)
+      return argv[i+1];
+  return nullptr;
+}
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+static bool farm_flag(int argc, char **argv, const char *name)
+{
+  for (int i = 2; i < argc; ++i)
+    if (std::string(argv[i]) == name)
+      return true;
+  return false;
+}
+
+int run_tile_farm(int argc, char **argv, int width, int height)
+{
+  const char *processes_option = farm_option(argc, argv, "--processes");
+  if (!processes_option)
+    return -1;
+  int processes = std::atoi(processes_option);
+  if (processes < 1 || !farm_flag(argc, argv, "--headless")) {
+    console::error("--processes expects a count of at least 1 and --headless, rendering in this process");
+    return -1; }
+  if (const char *size = farm_option(argc, argv, "--size"))
+    std::sscanf(size, "%dx%d", &width, &height);
+  unsigned tiles_x = (width + FARM_TILE - 1) / FARM_TILE, tiles_y = (height + FARM_TILE - 1) / FARM_TILE;
+  std::size_t bytes = sizeof(Farm_Frame) + sizeof(std::atomic<unsigned>) * tiles_x * tiles_y
+                    + 4 * sizeof(GLfloat) * width * height;
+  // the name is only needed until the mapping exists, the workers inherit it through fork
+  std::string name = "/ray-farm-" + std::to_string(getpid());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, bytes) < 0) {
+    console::error("can't create the shared frame ", name);
+    return 1; }
+  void *shared = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  shm_unlink(name.c_str());
+  if (shared == MAP_FAILED) {
+    console::error("can't map the shared frame");
+    return 1; }
+  Farm_Frame *frame = new (shared) Farm_Frame;
+  frame->next_tile = 0;
+  frame->tile_count = tiles_x * tiles_y;
+  frame->tiles_x = tiles_x;
+  frame->width = width;
+  frame->height = height;
+  for (unsigned t = 0; t < frame->tile_count; ++t)
+    new (frame->done() + t) std::atomic<unsigned>(0u);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<pid_t> workers;
+  for (int i = 1; i <= processes; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) { // a worker: no GL context exists yet, it creates its own in Application::init
+      farm = frame;
+      farm_worker = i;
+      return -1; }
+    if (pid < 0)
+      console::error("fork failed, ", i - 1, " workers");
+    else
+      workers.push_back(pid); }
+  console::log("tile farm: ", workers.size(), " processes, ", frame->tile_count, " tiles of ", FARM_TILE, 'x', FARM_TILE);
+  int failed = 0;
+  for (pid_t pid : workers) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0; }
+  std::vector<unsigned> tiles(processes + 1, 0u);
+  for (unsigned t = 0; t < frame->tile_count; ++t)
+    tiles[frame->done()[t].load(std::memory_order_acquire)]++;
+  int status = 0;
+  if (tiles[0] > 0) {
+    console::error(tiles[0], " tiles missing, ", failed, " workers failed");
+    status = 1; }
+  else {
+    if (failed > 0) {
+      console::error(failed, " workers failed, the others finished the frame");
+      status = 1; }
+    const char *output_option = farm_option(argc, argv, "--output");
+    std::string output = output_option ? output_option : std::string("renders/") + console::date_time() + ".png";
+    if (!encode_png(frame->pixels(), width, height, output))
+      status = 1;
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    console::log("rendered ", width, 'x', height, " in ", elapsed.count(), " ms to ", output);
+    for (int i = 1; i <= processes; ++i)
+      console::log("  worker ", i, ": ", tiles[i], " tiles"); }
+  munmap(shared, bytes);
+  return status;
+}
+#else
+int run_tile_farm(int argc, char **argv, int, int)
+{
+  if (farm_option(argc, argv, "--processes"))
+    console::error("--processes needs fork and POSIX shared memory, rendering in this process");
+  return -1;
+}
+#endif
@@ -1,10 +1,14 @@
 #include "ray-tracer-app.h"
+#include "farm.h"
 
 int main(int argc, char* argv[])
 {
+  int farm_status = run_tile_farm(argc, argv, 960, 640);
+  if (farm_status >= 0)
+    return farm_status;
   Ray_Tracer_App app;
   app.init(argc, argv, 960, 640);
   while (app.is_running())
     app.step();
-  app.exit();
+  return app.exit();
 }
\ No newline at end of file
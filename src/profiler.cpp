@@ -0,0 +1,110 @@
+#include "profiler.h"
+
+
+GLuint GPU_Profiler::next_query()
+{
+  Query_Set &set = sets[current];
+  if (set.used == set.pool.size()) {
+    GLuint query;
+    glGenQueries(1, &query);
+    set.pool.push_back(query); }
+  return set.pool[set.used++];
+}
+
+// Results of a set arrive in the order its queries were issued, so the last one decides
+void GPU_Profiler::collect(Query_Set &set)
+{
+  GLint available(GL_FALSE);
+  if (!set.records.empty())
+    glGetQueryObjectiv(set.records.back().end, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (available) {
+    std::vector<float> frame_ms(scopes.size(), -1.0f);
+    for (Record &r : set.records) {
+      GLuint64 begin_ns(0), end_ns(0);
+      glGetQueryObjectui64v(r.begin, GL_QUERY_RESULT, &begin_ns);
+      glGetQueryObjectui64v(r.end, GL_QUERY_RESULT, &end_ns);
+      frame_ms[r.scope] = std::max(frame_ms[r.scope], 0.0f) + (end_ns - begin_ns) * 1e-6f; }
+    for (std::size_t i = 0; i < scopes.size(); ++i)
+      if (frame_ms[i] >= 0.0f) {
+        Scope &s = scopes[i];
+        s.history[s.samples++ % PROFILER_HISTORY] = frame_ms[i]; } }
+  set.records.clear();
+  set.used = 0;
+}
+
+void GPU_Profiler::next_frame()
+{
+  current = (current + 1) % PROFILER_FRAMES;
+  collect(sets[current]);
+}
+
+void GPU_Profiler::begin(const char *name)
+{
+  if (!enabled)
+    return;
+  int scope = 0;
+  while (scope < int(scopes.size()) && scopes[scope].name != name)
+    ++scope;
+  if (scope == int(scopes.size()))
+    scopes.push_back({ name, std::vector<float>(PROFILER_HISTORY), 0 });
+  open.push_back({ scope, next_query(), 0 });
+  glQueryCounter(open.back().begin, GL_TIMESTAMP);
+}
+
+void GPU_Profiler::end()
+{
+  if (!enabled)
+    return;
+  Record r = open.back();
+  open.pop_back();
+  r.end = next_query();
+  glQueryCounter(r.end, GL_TIMESTAMP);
+  sets[current].records.push_back(r);
+}
+
+std::size_t GPU_Profiler::scope_count() const
+{
+  return scopes.size();
+}
+
+#include <algorithm>
+#include <cmath>
+Profiler_Stats GPU_Profiler::stats(std::size_t i) const
+{
+  const Scope &s = scopes[i];
+  Profiler_Stats result;
+  std::size_t n = std::min<std::size_t>(s.samples, PROFILER_HISTORY);
+  if (n == 0)
+    return result;
+  std::vector<float> window(s.history.begin(), s.history.begin() + n);
+  result.last_ms = s.history[(s.samples - 1) % PROFILER_HISTORY];
+  result.min_ms = *std::min_element(window.begin(), window.end());
+  for (float ms : window)
+    result.avg_ms += ms / n;
+  auto p99 = window.begin() + (std::size_t(std::ceil(0.99 * n)) - 1);
+  std::nth_element(window.begin(), p99, window.end());
+  result.p99_ms = *p99;
+  return result;
+}
+
+#include <iomanip>
+std::string GPU_Profiler::report() const
+{
+  std::stringstream ss;
+  ss << "GPU time (ms)       last     min     avg     p99";
+  for (std::size_t i = 0; i < scopes.size(); ++i) {
+    Profiler_Stats s = stats(i);
+    ss << '\n' << std::left << std::setw(12) << scopes[i].name << std::right << std::fixed << std::setprecision(3)
+       << std::setw(12) << s.last_ms << std::setw(8) << s.min_ms << std::setw(8) << s.avg_ms << std::setw(8) << s.p99_ms; }
+  return ss.str();
+}
+
+void GPU_Profiler::release()
+{
+  for (Query_Set &set : sets) {
+    if (!set.pool.empty())
+      glDeleteQueries(GLsizei(set.pool.size()), set.pool.data());
+    set.pool.clear();
+    set.used = 0;
+    set.records.clear(); }
+}
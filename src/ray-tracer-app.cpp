@@ -1,77 +1,1037 @@
 #include "ray-tracer-app.h"
+#include "sampler.h"
+#include "profiler.h"
+#include "workers.h"
+#include "capture.h"
+#include "batch.h"
+#include "farm.h"
+#include "cpu-tracer.h"
 
 
 
-#define NUM_BUFFERS 6
+#define NUM_BUFFERS 22
 #define EBUF 0
 #define VBUF 1
 #define HEAP 2
 #define GBUF 3
 #define MBUF 4
 #define LBUF 5
+#define BVHBUF 6
+#define RAYQ 7
+#define HITQ 8
+#define SHADOWQ 9
+#define QSTATE 10
+#define RADIANCE 11
+#define MESH_VERTICES 12
+#define MESH_FACES 13
+#define MESH_BVH 14
+#define ACTIVE_TILES 15
+#define TILE_READBACK 16
+#define SAMPLER_STATE 17
+#define SPHERE_TABLE 18
+#define PLANE_TABLE 19
+#define MESH_TABLE 20
+#define LIGHT_TABLE 21
 
-Shader ray_shader, render_shader;
-GLuint render_tex, render_vao, bufferID[NUM_BUFFERS];
+// kernel entry points of ray-compute.glsl, selected with the STAGE define
+#define STAGE_MEGAKERNEL 0
+#define STAGE_GENERATE   1
+#define STAGE_EXTEND     2
+#define STAGE_SHADE      3
+#define STAGE_CONNECT    4
+#define STAGE_RESOLVE    5
+#define STAGE_ARGS       6
+#define STAGE_CONVERGE   7
+#define WAVEFRONT_STAGES 6
+#define WAVEFRONT_GROUP 64
+#define WAVE_PATHS (1<<20) // path budget of one wavefront wave, bounds queue memory at high resolutions
+#define MAX_DEPTH 5
+#define MIN_RENDER_SCALE 0.25f
+#define MAX_RENDER_SCALE 2.0f
+#define RENDER_SCALE_STEP 0.25f
+#define DYNRES_GROW_BELOW 0.7f  // fraction of the budget under which the resolution grows
+#define DYNRES_QUANTUM 0.0625f  // scales snap to 1/16 so measurement noise can't reallocate every frame
+#define DYNRES_SETTLE 8         // frames measured at a new scale before it may change again
+#define ADAPTIVE_MIN_SAMPLES 16 // samples every pixel gets before its variance is trusted
+#define UNROLL_MAX_SHAPES 8     // scenes up to this size get their ray casts generated as straight-line code
+#define UNROLL_MAX_LIGHTS 4
+#define KERNEL_VARIANTS 24    // linked kernels kept for reuse, room for a tile benchmark and two sets of passes
 
-void Ray_Tracer_App::on_init()
+Shader ray_shader, converge_shader, render_shader, wavefront_shader[WAVEFRONT_STAGES];
+GLuint render_tex, moment_tex, sobol_tex, render_vao, bufferID[NUM_BUFFERS];
+GLuint accum_tex[2], gbuffer_tex[2]; // ping-ponged by camera moves, [current_history] is written
+unsigned current_history = 0;
+GLuint frame_index = 0;
+GLuint frame_seed = 0;
+GLuint *active_tile_count = nullptr; // persistently mapped TILE_READBACK
+GLsync convergence_fence = 0;        // pending copy of the active tile count into TILE_READBACK
+unsigned dirty = clean;
+bool kernels_pending = false; // build_ray_shader or build_wavefront started links finish_kernels hasn't seen complete
+Scene_Variant scene_variant;
+GPU_Profiler profiler;
+Staging_Ring heap_staging;
+Worker_Pool png_workers;
+std::atomic<bool> save_failed(false); // a png couldn't be written, main exits non-zero
+std::vector<Pending_Capture> captures;
+unsigned capture_count = 0;
+Frame_Stream frame_stream;
+bool capture_converged = false; // stream only images done accumulating instead of every presented frame
+Uint32 init_ticks = 0, render_ticks = 0; // when on_init began and ended, for the --headless statistics
+#include <fstream>
+std::string scene_file; // the program argument, or the scene of the current batch job
+std::vector<Batch_Job> batch;
+std::size_t current_job = 0;
+Uint32 job_ticks = 0, job_load_ms = 0;
+std::size_t job_upload = 0; // scene bytes the current job sent over the previous one's
+std::ofstream batch_results;
+CPU_Tracer cpu_tracer;
+bool show_profiler = false; // bars of the profiled scopes over the image, toggled with p
+std::unordered_map<std::string, GLuint> kernel_variants; // linked kernels by Shader::key
+#include <list>
+std::list<std::string> variant_lru; // keys of kernel_variants, the most recently used last
+
+// horizontal extent of the view for the window's shape, 0.66 at the original 960x640
+float camera_aspect(const App_Data &a)
 {
-  render_shader.handle = glCreateProgram();
-  render_shader.create(GL_VERTEX_SHADER, GL_FRAGMENT_SHADER);
-  render_shader.source("shader/window-quad.glsl");
-  render_shader.compile();
-  render_shader.link();
-  ray_shader.handle = glCreateProgram();
-  ray_shader.create(GL_COMPUTE_SHADER);
-  ray_shader.source("shader/ray-compute.glsl");
-  ray_shader.compile();
-  ray_shader.link();
-  glCreateVertexArrays(1, &render_vao);
-  glCreateBuffers(NUM_BUFFERS, bufferID);
-  GLuint window_quad_EB[6] = { 0u,1u,2u, 2u,3u,0u };
-  glNamedBufferData(bufferID[EBUF], sizeof(window_quad_EB), window_quad_EB, GL_STATIC_DRAW);
-  glVertexArrayElementBuffer(render_vao, bufferID[EBUF]);
-  GLfloat window_quad_VB[16] = { -1.0f,+1.0f,0.0f,0.0f, +1.0f,+1.0f,1.0f,0.0f, +1.0f,-1.0f,1.0f,1.0f, -1.0f,-1.0f,0.0f,1.0f };
-  glNamedBufferData(bufferID[VBUF], sizeof(window_quad_VB), window_quad_VB, GL_STATIC_DRAW);
-  glVertexArrayVertexBuffer(render_vao, 0, bufferID[VBUF], 0, 16);
-  glEnableVertexArrayAttrib(render_vao, 0);
-  glVertexArrayAttribFormat(render_vao, 0, 4, GL_FLOAT, GL_FALSE, 0);
-  glVertexArrayAttribBinding(render_vao, 0, 0);
-  if (app_data.argc < 2)
-    console::error("Expected 1 program argument: scene file missing");
-  scene.translate_file(app_data.argv[1]);
-  scene.regenerate_bufs();
-  glNamedBufferData(bufferID[HEAP], sizeof(GLfloat)*scene.heap.size(), scene.heap.data(), GL_DYNAMIC_DRAW);
+  return 0.44f * a.width / a.height;
+}
+
+void release_heap_staging()
+{
+  if (heap_staging.buffer) {
+    glUnmapNamedBuffer(heap_staging.buffer);
+    glDeleteBuffers(1, &heap_staging.buffer); }
+  for (GLsync &fence : heap_staging.fence)
+    if (fence) {
+      glDeleteSync(fence);
+      fence = 0; }
+  heap_staging = Staging_Ring();
+}
+
+#include <algorithm>
+#include <cstring>
+// HEAP gets immutable storage that only copies write to, and the staging ring is sized to match.
+// A heap of a new size (hot reload) replaces both. Returns the bytes sent.
+std::size_t allocate_heap(Scene_Interpreter &scene)
+{
+  GLsizeiptr bytes = std::max<GLsizeiptr>(sizeof(GLfloat)*scene.heap.size(), sizeof(GLfloat));
+  if (heap_staging.buffer) {
+    release_heap_staging();
+    glDeleteBuffers(1, &bufferID[HEAP]);
+    glCreateBuffers(1, &bufferID[HEAP]); }
+  glNamedBufferStorage(bufferID[HEAP], bytes, nullptr, GL_DYNAMIC_STORAGE_BIT);
+  glNamedBufferSubData(bufferID[HEAP], 0, sizeof(GLfloat)*scene.heap.size(), scene.heap.data());
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, bufferID[HEAP]);
+  heap_staging.region_size = bytes;
+  glCreateBuffers(1, &heap_staging.buffer);
+  glNamedBufferStorage(heap_staging.buffer, bytes * STAGING_REGIONS, nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT);
+  heap_staging.mapped = (char*)glMapNamedBufferRange(heap_staging.buffer, 0, bytes * STAGING_REGIONS,
+                                                      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+  return sizeof(GLfloat)*scene.heap.size();
+}
+
+// Marks count floats from first as edited, flush_heap_edits sends them with the next frame
+void stage_heap_edit(std::size_t first, std::size_t count)
+{
+  heap_staging.dirty_lo = std::min(heap_staging.dirty_lo, sizeof(GLfloat) * first);
+  heap_staging.dirty_hi = std::max(heap_staging.dirty_hi, sizeof(GLfloat) * (first + count));
+}
+
+void flush_heap_edits(const std::vector<float> &heap)
+{
+  Staging_Ring &ring = heap_staging;
+  if (ring.dirty_lo >= ring.dirty_hi || !ring.mapped) // no heap buffer for the cpu integrator
+    return;
+  GLsync &fence = ring.fence[ring.next];
+  if (fence) { // STAGING_REGIONS frames old, normally long signalled
+    glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000u);
+    glDeleteSync(fence); }
+  GLintptr region = ring.next * ring.region_size;
+  GLsizeiptr bytes = ring.dirty_hi - ring.dirty_lo;
+  std::memcpy(ring.mapped + region + ring.dirty_lo, (const char*)heap.data() + ring.dirty_lo, bytes);
+  glFlushMappedNamedBufferRange(ring.buffer, region + ring.dirty_lo, bytes);
+  glCopyNamedBufferSubData(ring.buffer, bufferID[HEAP], region + ring.dirty_lo, ring.dirty_lo, bytes);
+  fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  ring.next = (ring.next + 1) % STAGING_REGIONS;
+  ring.dirty_lo = ~std::size_t(0);
+  ring.dirty_hi = 0;
+}
+
+std::size_t upload_light_table(Scene_Interpreter &scene)
+{
+  glNamedBufferData(bufferID[LIGHT_TABLE], sizeof(Light_Record)*scene.light_table.size(), scene.light_table.data(), GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, bufferID[LIGHT_TABLE]);
+  return sizeof(Light_Record)*scene.light_table.size();
+}
+
+std::size_t upload_index_bufs(Scene_Interpreter &scene)
+{
   glNamedBufferData(bufferID[GBUF], sizeof(GLint)*scene.gbuf.size(), scene.gbuf.data(), GL_DYNAMIC_DRAW);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, bufferID[GBUF]);
   glNamedBufferData(bufferID[MBUF], sizeof(GLint)*scene.mbuf.size(), scene.mbuf.data(), GL_DYNAMIC_DRAW);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, bufferID[MBUF]);
   glNamedBufferData(bufferID[LBUF], sizeof(GLint)*scene.lbuf.size(), scene.lbuf.data(), GL_DYNAMIC_DRAW);
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, bufferID[LBUF]);
+  glNamedBufferData(bufferID[BVHBUF], sizeof(BVH_Node)*scene.bvh.size(), scene.bvh.data(), GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, bufferID[BVHBUF]);
+  glNamedBufferData(bufferID[SPHERE_TABLE], sizeof(glm::vec4)*scene.sphere_table.size(), scene.sphere_table.data(), GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, bufferID[SPHERE_TABLE]);
+  glNamedBufferData(bufferID[PLANE_TABLE], sizeof(glm::vec4)*scene.plane_table.size(), scene.plane_table.data(), GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, bufferID[PLANE_TABLE]);
+  glNamedBufferData(bufferID[MESH_TABLE], sizeof(glm::vec4)*scene.mesh_table.size(), scene.mesh_table.data(), GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, bufferID[MESH_TABLE]);
+  return sizeof(GLint)*(scene.gbuf.size() + scene.mbuf.size() + scene.lbuf.size()) + sizeof(BVH_Node)*scene.bvh.size()
+       + sizeof(glm::vec4)*(scene.sphere_table.size() + scene.plane_table.size() + scene.mesh_table.size())
+       + upload_light_table(scene);
+}
+
+// Mesh data is immutable after loading, menu edits only move the top level bvh
+std::size_t upload_mesh_bufs(Scene_Interpreter &scene)
+{
+  glNamedBufferData(bufferID[MESH_VERTICES], sizeof(glm::vec4)*scene.mesh_vertices.size(), scene.mesh_vertices.data(), GL_STATIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, bufferID[MESH_VERTICES]);
+  glNamedBufferData(bufferID[MESH_FACES], sizeof(glm::uvec4)*scene.mesh_faces.size(), scene.mesh_faces.data(), GL_STATIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, bufferID[MESH_FACES]);
+  glNamedBufferData(bufferID[MESH_BVH], sizeof(BVH_Node)*scene.mesh_bvh.size(), scene.mesh_bvh.data(), GL_STATIC_DRAW);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, bufferID[MESH_BVH]);
+  return sizeof(glm::vec4)*scene.mesh_vertices.size() + sizeof(glm::uvec4)*scene.mesh_faces.size() + sizeof(BVH_Node)*scene.mesh_bvh.size();
+}
+
+// Uploads the runs of elements that differ from what the buffer holds, all of it if the size changed.
+// Returns the bytes sent.
+template<typename T>
+std::size_t patch_buffer(GLuint buffer, const std::vector<T> &now, const std::vector<T> &was, GLenum usage = GL_DYNAMIC_DRAW)
+{
+  if (now.size() != was.size()) {
+    glNamedBufferData(buffer, sizeof(T)*now.size(), now.data(), usage);
+    return sizeof(T)*now.size(); }
+  std::size_t i = 0, sent = 0;
+  while (i < now.size()) {
+    if (std::memcmp(&now[i], &was[i], sizeof(T)) == 0) {
+      ++i;
+      continue; }
+    std::size_t first = i;
+    while (i < now.size() && std::memcmp(&now[i], &was[i], sizeof(T)) != 0)
+      ++i;
+    glNamedBufferSubData(buffer, sizeof(T)*first, sizeof(T)*(i - first), &now[first]);
+    sent += sizeof(T)*(i - first); }
+  return sent;
+}
+
+std::size_t patch_scene_bufs(Scene_Interpreter &now, Scene_Interpreter &was)
+{
+  std::size_t heap_bytes = sizeof(GLfloat) * now.heap.size();
+  if (now.heap.size() != was.heap.size())
+    allocate_heap(now);
+  else {
+    heap_bytes = 0;
+    for (std::size_t i = 0; i < now.heap.size(); ++i)
+      if (now.heap[i] != was.heap[i]) {
+        stage_heap_edit(i, 1);
+        heap_bytes += sizeof(GLfloat); } }
+  return heap_bytes
+       + patch_buffer(bufferID[GBUF], now.gbuf, was.gbuf)
+       + patch_buffer(bufferID[MBUF], now.mbuf, was.mbuf)
+       + patch_buffer(bufferID[LBUF], now.lbuf, was.lbuf)
+       + patch_buffer(bufferID[BVHBUF], now.bvh, was.bvh)
+       + patch_buffer(bufferID[SPHERE_TABLE], now.sphere_table, was.sphere_table)
+       + patch_buffer(bufferID[PLANE_TABLE], now.plane_table, was.plane_table)
+       + patch_buffer(bufferID[MESH_TABLE], now.mesh_table, was.mesh_table)
+       + patch_buffer(bufferID[LIGHT_TABLE], now.light_table, was.light_table)
+       + patch_buffer(bufferID[MESH_VERTICES], now.mesh_vertices, was.mesh_vertices, GL_STATIC_DRAW)
+       + patch_buffer(bufferID[MESH_FACES], now.mesh_faces, was.mesh_faces, GL_STATIC_DRAW)
+       + patch_buffer(bufferID[MESH_BVH], now.mesh_bvh, was.mesh_bvh, GL_STATIC_DRAW);
+}
+
+// Menu edits recompile the tables on the cpu and send only the elements that changed, a moved object
+// rarely reorders more than a few bvh nodes. Nothing is sent for the cpu integrator, it has no buffers.
+std::size_t patch_index_bufs(Scene_Interpreter &scene)
+{
+  std::vector<int> gbuf = scene.gbuf, mbuf = scene.mbuf, lbuf = scene.lbuf;
+  std::vector<BVH_Node> bvh = scene.bvh;
+  std::vector<glm::vec4> spheres = scene.sphere_table, planes = scene.plane_table, meshes = scene.mesh_table;
+  std::vector<Light_Record> lights = scene.light_table;
+  scene.regenerate_bufs();
+  if (!heap_staging.buffer)
+    return 0;
+  return patch_buffer(bufferID[GBUF], scene.gbuf, gbuf)
+       + patch_buffer(bufferID[MBUF], scene.mbuf, mbuf)
+       + patch_buffer(bufferID[LBUF], scene.lbuf, lbuf)
+       + patch_buffer(bufferID[BVHBUF], scene.bvh, bvh)
+       + patch_buffer(bufferID[SPHERE_TABLE], scene.sphere_table, spheres)
+       + patch_buffer(bufferID[PLANE_TABLE], scene.plane_table, planes)
+       + patch_buffer(bufferID[MESH_TABLE], scene.mesh_table, meshes)
+       + patch_buffer(bufferID[LIGHT_TABLE], scene.light_table, lights);
+}
+
+std::size_t patch_light_table(Scene_Interpreter &scene)
+{
+  std::vector<Light_Record> lights = scene.light_table;
+  scene.compile_lights();
+  return heap_staging.buffer ? patch_buffer(bufferID[LIGHT_TABLE], scene.light_table, lights) : 0;
+}
+
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+// Where the benchmark keeps its winner for this renderer, so only the first launch on a driver pays for it
+std::string tile_cache_path()
+{
+  std::uint64_t h = 14695981039346656037ull; // FNV-1a
+  for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+    for (const GLubyte *c = glGetString(name); c && *c; ++c) {
+      h ^= *c;
+      h *= 1099511628211ull; }
+  std::stringstream ss;
+  ss << PROGRAM_CACHE_DIR "/tile-" << std::hex << std::setw(16) << std::setfill('0') << h << ".txt";
+  return ss.str();
+}
+
+// The cpu integrator compiles no kernels, presenting and reading back render_tex takes 4.5 and its DSA.
+// Headless it needs no context at all, unless frames are streamed or shaders watched.
+void Ray_Tracer_App::on_configure()
+{
+  const char *integrator_option = option("--integrator");
+  if (!integrator_option || std::string(integrator_option) != "cpu" || farm)
+    return;
+  app_data.gl_minor = 5;
+  app_data.gl = !app_data.headless || option("--capture") || flag("--watch");
+}
+
+#include <cstdio>
+#include <thread>
+// The scene is parsed on a worker thread while this one sets up GL. The kernels link in the background,
+// on_update presents a placeholder until they are done, see finish_kernels.
+void Ray_Tracer_App::on_init()
+{
+  init_ticks = SDL_GetTicks();
+  if (app_data.argc < 2)
+    console::error("Expected 1 program argument: scene file missing");
+  if (farm && (app_data.width != farm->width || app_data.height != farm->height)) { // its tiles wouldn't fit the shared frame
+    console::error("worker ", farm_worker, " renders ", app_data.width, 'x', app_data.height, ", the shared frame is ", farm->width, 'x', farm->height);
+    app_data.running = false;
+    app_data.exit_code = 1;
+    return; }
+  auto vec3_option = [this](const char *name, glm::vec3 fallback) {
+    const char *value = option(name);
+    glm::vec3 v;
+    if (!value)
+      return fallback;
+    if (std::sscanf(value, "%f,%f,%f", &v.x, &v.y, &v.z) != 3) {
+      console::error(name, " expects x,y,z, got ", value);
+      return fallback; }
+    return v; };
+  const char *fov_option = option("--fov");
+  const char *max_samples_option = option("--max-samples");
+  Batch_Job defaults { app_data.argv[1], "",
+                       vec3_option("--eye", glm::vec3(8.0f,5.0f,9.0f)), vec3_option("--target", glm::vec3(0.25f, 0.0f, 0.5f)),
+                       fov_option ? std::stof(fov_option) : 30.0f, max_samples_option ? unsigned(std::stoul(max_samples_option)) : 1024u };
+  if (flag("--batch")) {
+    batch = read_manifest(app_data.argv[1], defaults);
+    if (batch.empty()) {
+      console::error("no jobs in ", app_data.argv[1]);
+      app_data.running = false;
+      app_data.exit_code = 1;
+      return; }
+    defaults = batch.front(); }
+  scene_file = defaults.scene;
+  std::string scene_error;
+  bool scene_loaded = false;
+  std::thread parser([this, &scene_loaded, &scene_error]() { scene_loaded = scene.load(scene_file, scene_error); });
+  png_workers.start(2, MAX_PENDING_CAPTURES);
+  const char *integrator_option = option("--integrator");
+  integrator = megakernel;
+  if (integrator_option && std::string(integrator_option) == "wavefront" && !farm)
+    integrator = wavefront;
+  if (integrator_option && std::string(integrator_option) == "cpu" && !farm)
+    integrator = cpu;
+  profiler.enabled = app_data.gl;
+  if (app_data.gl) {
+    render_shader.handle = glCreateProgram();
+    render_shader.create(GL_VERTEX_SHADER, GL_FRAGMENT_SHADER);
+    render_shader.source("shader/window-quad.glsl");
+    render_shader.compile();
+    render_shader.link(false);
+    glCreateVertexArrays(1, &render_vao);
+    glCreateBuffers(NUM_BUFFERS, bufferID);
+    GLuint window_quad_EB[6] = { 0u,1u,2u, 2u,3u,0u };
+    glNamedBufferData(bufferID[EBUF], sizeof(window_quad_EB), window_quad_EB, GL_STATIC_DRAW);
+    glVertexArrayElementBuffer(render_vao, bufferID[EBUF]);
+    GLfloat window_quad_VB[16] = { -1.0f,+1.0f,0.0f,0.0f, +1.0f,+1.0f,1.0f,0.0f, +1.0f,-1.0f,1.0f,1.0f, -1.0f,-1.0f,0.0f,1.0f };
+    glNamedBufferData(bufferID[VBUF], sizeof(window_quad_VB), window_quad_VB, GL_STATIC_DRAW);
+    glVertexArrayVertexBuffer(render_vao, 0, bufferID[VBUF], 0, 16);
+    glEnableVertexArrayAttrib(render_vao, 0);
+    glVertexArrayAttribFormat(render_vao, 0, 4, GL_FLOAT, GL_FALSE, 0);
+    glVertexArrayAttribBinding(render_vao, 0, 0);
+    glBindVertexArray(render_vao); }
+  if (integrator != cpu) { // the kernels' readback and sample tables, the cpu integrator has its own
+    GLbitfield readback_flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glNamedBufferStorage(bufferID[TILE_READBACK], sizeof(GLuint), nullptr, readback_flags);
+    active_tile_count = (GLuint*)glMapNamedBufferRange(bufferID[TILE_READBACK], 0, sizeof(GLuint), readback_flags);
+    std::vector<uint32_t> sobol = sobol_direction_numbers();
+    glCreateTextures(GL_TEXTURE_2D, 1, &sobol_tex);
+    glTextureParameteri(sobol_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(sobol_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureStorage2D(sobol_tex, 1, GL_R32UI, SOBOL_BITS, SOBOL_DIMS);
+    glTextureSubImage2D(sobol_tex, 0, 0, 0, SOBOL_BITS, SOBOL_DIMS, GL_RED_INTEGER, GL_UNSIGNED_INT, sobol.data());
+    glBindTextureUnit(1, sobol_tex); }
+  const char *scale_option = option("--scale");
+  render_scale = scale_option && !farm ? glm::clamp(std::stof(scale_option), MIN_RENDER_SCALE, MAX_RENDER_SCALE) : 1.0f;
+  resize_render_targets();
+  accumulate = flag("--accumulate") || app_data.headless || !batch.empty();
+  max_samples = defaults.samples;
+  const char *threshold_option = option("--threshold");
+  error_threshold = threshold_option ? std::stof(threshold_option) : 0.0f;
+  if (error_threshold > 0.0f && integrator != megakernel) { // the tile variance comes from the megakernel only
+    console::error("--threshold needs the megakernel integrator, sampling every pixel to --max-samples");
+    error_threshold = 0.0f; }
+  cam = new PinholeCamera(defaults.eye, defaults.target, defaults.fov, camera_aspect(app_data));
+  traced_cam = new PinholeCamera(*cam);
+  temporal = !flag("--no-reprojection");
+  bool generic = flag("--generic-kernel");
+  const char *tile_option = option("--tile");
+  bool auto_tile = tile_option == nullptr || std::string(tile_option) == "auto";
+  bool benchmark = integrator != cpu && auto_tile && !farm;
+  if (benchmark && tile_option == nullptr) { // a tile measured on this renderer before, --tile auto measures again
+    std::ifstream cached(tile_cache_path());
+    char x = 0;
+    benchmark = !(cached >> tile.x >> x >> tile.y) || x != 'x' || tile.x < 1 || tile.y < 1; }
+  if (farm && auto_tile) // the workers share one gpu, timing the candidates in each would measure the others
+    tile = glm::ivec2(8, 8);
+  bool tile_error = integrator != cpu && !auto_tile
+                    && (std::sscanf(tile_option, "%dx%d", &tile.x, &tile.y) != 2 || tile.x < 1 || tile.y < 1);
+  benchmark |= tile_error;
+  if (generic && !benchmark && integrator != cpu) // the generic kernel doesn't depend on the scene, it can compile while it's parsed
+    build_ray_shader();
+  parser.join();
+  if (!scene_loaded) {
+    console::error(scene_error);
+    app_data.running = false;
+    app_data.exit_code = 1;
+    return; }
+  if (tile_error)
+    console::error("--tile expects WxH or auto, got ", tile_option);
+  scene_variant = scene.variant(!generic);
+  if (integrator != cpu)
+    job_upload = allocate_heap(scene) + upload_index_bufs(scene) + upload_mesh_bufs(scene);
+  if (benchmark)
+    benchmark_tile_sizes();
+  if (integrator == cpu) { // no compute kernels, GL only presents and reads back render_tex
+    const char *threads_option = option("--threads");
+    unsigned threads = threads_option ? unsigned(std::stoul(threads_option)) : std::thread::hardware_concurrency();
+    cpu_tracer.start(threads);
+    console::log("cpu integrator: ", std::max(threads, 1u), " threads"); }
+  else if (!kernels_pending)
+    build_ray_shader();
+  if (integrator == wavefront)
+    build_wavefront();
+  if (app_data.gl) {
+    render_shader.finish();
+    glGenQueries(2, dynres.query); }
+  if (integrator != cpu)
+    console::log("compute tile: ", tile.x, 'x', tile.y);
+  console::log("render resolution: ", resolution.x, 'x', resolution.y, " (", render_scale, "x)");
+  const char *target_option = option("--target-ms");
+  dynres.enabled = target_option != nullptr && integrator != cpu;
+  dynres.target_ms = target_option ? std::stof(target_option) : app_data.ms_per_frame;
+  if (dynres.enabled)
+    console::log("dynamic resolution: ", dynres.target_ms, " ms GPU budget");
+  if (const char *capture_option = option("--capture")) {
+    capture_converged = flag("--capture-converged");
+    if (!frame_stream.open(capture_option, resolution.x, resolution.y, app_data.fps, flag("--capture-block")))
+      app_data.exit_code = 1; }
+  menu.build(&scene);
+  if (flag("--watch") && watcher.start()) {
+    for (const char *path : { "shader/ray-compute.glsl", "shader/window-quad.glsl", scene_file.c_str() })
+      watcher.watch(path);
+    for (Scene_Mesh &m : scene.mesh)
+      watcher.watch(m.file);
+    console::log("watching the shaders and the scene for changes"); }
+  render_ticks = SDL_GetTicks();
+  if (!batch.empty()) {
+    const char *results_option = option("--results");
+    std::string results = results_option ? results_option : std::string("renders/batch-") + console::date_time() + ".csv";
+    batch_results.open(results);
+    if (!batch_results) {
+      console::error("can't write batch results to ", results);
+      app_data.exit_code = 1; }
+    batch_results << "job,scene,output,samples,load_ms,render_ms,ms_per_sample,upload_bytes,status\n";
+    console::log("rendering ", batch.size(), " jobs, results in ", results);
+    job_ticks = init_ticks; // the first job's load is the whole setup, its scene was sent in full
+    job_load_ms = render_ticks - init_ticks;
+    if (app_data.headless)
+      return; }
+  else if (app_data.headless) {
+    console::log("rendering ", max_samples, " samples headless");
+    return; }
+  console::log();
+  menu.print(with_header);
+}
+
+// Deletes the least recently used variants past KERNEL_VARIANTS, skipping the ones a kernel still runs
+void evict_kernel_variants()
+{
+  auto in_use = [](GLuint handle) {
+    if (ray_shader.handle == handle || converge_shader.handle == handle)
+      return true;
+    for (Shader &k : wavefront_shader)
+      if (k.handle == handle)
+        return true;
+    return false; };
+  for (auto key = variant_lru.begin(); key != variant_lru.end() && kernel_variants.size() > KERNEL_VARIANTS;) {
+    auto variant = kernel_variants.find(*key);
+    if (in_use(variant->second)) {
+      ++key;
+      continue; }
+    glDeleteProgram(variant->second);
+    kernel_variants.erase(variant);
+    key = variant_lru.erase(key); }
+}
+
+// Linked kernels stay in kernel_variants, so a tile shape or pass compiled before costs no recompile
+void Ray_Tracer_App::compile_kernel(Shader &kernel, int stage)
+{
+  kernel.finish();
+  kernel.define("TILE_W", std::to_string(tile.x));
+  kernel.define("TILE_H", std::to_string(tile.y));
+  kernel.define("MAX_DEPTH", std::to_string(MAX_DEPTH));
+  kernel.define("SOBOL_DIMS", std::to_string(SOBOL_DIMS));
+  kernel.define("STAGE", std::to_string(stage));
+  for (auto &d : scene_variant.defines)
+    kernel.define(d.first.c_str(), d.second);
+  kernel.generate(scene_variant.code);
+  std::string key = kernel.key("shader/ray-compute.glsl");
+  auto cached = kernel_variants.find(key);
+  if (cached != kernel_variants.end()) {
+    variant_lru.splice(variant_lru.end(), variant_lru, std::find(variant_lru.begin(), variant_lru.end(), key));
+    kernel.adopt(cached->second);
+    return; }
+  kernel.handle = glCreateProgram();
+  kernel.create(GL_COMPUTE_SHADER);
+  kernel.source("shader/ray-compute.glsl");
+  kernel.compile();
+  kernel.link(false);
+  kernel_variants[key] = kernel.handle;
+  variant_lru.push_back(key);
+  evict_kernel_variants();
+}
+
+void Ray_Tracer_App::build_ray_shader()
+{
+  compile_kernel(ray_shader, STAGE_MEGAKERNEL);
+  compile_kernel(converge_shader, STAGE_CONVERGE);
+  size_active_tiles();
+  if (wavefront_shader[0].handle)
+    for (int stage = STAGE_GENERATE; stage <= STAGE_ARGS; ++stage)
+      compile_kernel(wavefront_shader[stage - STAGE_GENERATE], stage);
+  kernels_pending = true;
+  dirty |= dirty_shader;
+}
+
+// The variant bakes the table layout in, so the kernels are rebuilt whenever regenerate_bufs reordered it
+void Ray_Tracer_App::refresh_variant()
+{
+  Scene_Variant variant = scene.variant(!flag("--generic-kernel"));
+  if (variant.defines == scene_variant.defines && variant.code == scene_variant.code)
+    return;
+  scene_variant = variant;
+  if (integrator != cpu)
+    build_ray_shader();
+}
+
+#include <algorithm>
+// Compiles the wavefront passes and sizes their queues on first use.
+void Ray_Tracer_App::build_wavefront()
+{
+  if (wavefront_shader[0].handle)
+    return;
+  for (int stage = STAGE_GENERATE; stage <= STAGE_ARGS; ++stage)
+    compile_kernel(wavefront_shader[stage - STAGE_GENERATE], stage);
+  kernels_pending = true;
+  size_wavefront_queues();
+}
+
+void Ray_Tracer_App::size_wavefront_queues()
+{
+  int pixels = resolution.x * resolution.y;
+  int lights = std::max<int>(1, scene.light.size());
+  wave_size = std::min(pixels, std::max(1, WAVE_PATHS / lights));
+  glNamedBufferData(bufferID[RAYQ], 2 * wave_size * 3*sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+  glNamedBufferData(bufferID[HITQ], wave_size * 3*sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+  glNamedBufferData(bufferID[SHADOWQ], wave_size * lights * 3*sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+  glNamedBufferData(bufferID[QSTATE], 8*sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+  glNamedBufferData(bufferID[RADIANCE], 3 * pixels * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+  glClearNamedBufferData(bufferID[RADIANCE], GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+  for (int i = 0; i < 5; ++i)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5 + i, bufferID[RAYQ + i]);
+  upload_uniforms();
+}
+
+// (Re)allocates the images the kernels trace into at the window size times render_scale.
+// Presenting samples render_tex with bilinear filtering, so any scale fills the window.
+void Ray_Tracer_App::resize_render_targets()
+{
+  resolution = glm::max(glm::ivec2(1), glm::ivec2(glm::round(glm::vec2(app_data.width, app_data.height) * render_scale)));
+  if (farm) // a worker traces one tile of the shared frame at a time
+    resolution = glm::ivec2(FARM_TILE);
+  dirty |= dirty_size;
+  if (!app_data.gl) // headless on the cpu, cpu_tracer.image is the whole result
+    return;
+  if (render_tex)
+    glDeleteTextures(1, &render_tex);
   glCreateTextures(GL_TEXTURE_2D, 1, &render_tex);
   glTextureParameteri(render_tex, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTextureParameteri(render_tex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTextureParameteri(render_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTextureParameteri(render_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTextureStorage2D(render_tex, 1, GL_RGBA32F, app_data.width, app_data.height);
+  glTextureParameteri(render_tex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTextureParameteri(render_tex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTextureStorage2D(render_tex, 1, GL_RGBA32F, resolution.x, resolution.y);
+  glViewport(0, 0, app_data.width, app_data.height);
+  if (integrator == cpu) // render_tex is only presented and read back, the images below are the kernels'
+    return;
   glBindImageTexture(0, render_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-  glBindVertexArray(render_vao);
-  cam = new PinholeCamera(glm::vec3(8.0f,5.0f,9.0f), glm::vec3(0.25f, 0.0f, 0.5f), 30.0, 0.66f);
+  if (accum_tex[0]) {
+    glDeleteTextures(2, accum_tex);
+    glDeleteTextures(2, gbuffer_tex); }
+  glCreateTextures(GL_TEXTURE_2D, 2, accum_tex);
+  glCreateTextures(GL_TEXTURE_2D, 2, gbuffer_tex);
+  for (int i = 0; i < 2; ++i) {
+    glTextureStorage2D(accum_tex[i], 1, GL_RGBA32F, resolution.x, resolution.y);
+    glTextureStorage2D(gbuffer_tex[i], 1, GL_RGBA32F, resolution.x, resolution.y); }
+  bind_history();
+  if (moment_tex)
+    glDeleteTextures(1, &moment_tex);
+  glCreateTextures(GL_TEXTURE_2D, 1, &moment_tex);
+  glTextureStorage2D(moment_tex, 1, GL_R32F, resolution.x, resolution.y);
+  glBindImageTexture(2, moment_tex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+  std::vector<uint32_t> seeds = pcg_seeds(resolution.x * resolution.y);
+  profiler.begin("upload");
+  glNamedBufferData(bufferID[SAMPLER_STATE], sizeof(uint32_t)*seeds.size(), seeds.data(), GL_DYNAMIC_COPY);
+  profiler.end();
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, bufferID[SAMPLER_STATE]);
+  if (wavefront_shader[0].handle)
+    size_wavefront_queues();
+  if (converge_shader.handle)
+    size_active_tiles();
+}
+
+// Binds the accumulation and g-buffer images the next dispatch writes, and the other pair as history
+void Ray_Tracer_App::bind_history()
+{
+  unsigned previous = current_history ^ 1u;
+  glBindImageTexture(1, accum_tex[current_history], 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+  glBindImageTexture(3, gbuffer_tex[current_history], 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+  glBindImageTexture(4, accum_tex[previous], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+  glBindImageTexture(5, gbuffer_tex[previous], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+}
+
+// Turns the camera around its target by yaw and pitch (radians) and scales its distance by zoom
+void Ray_Tracer_App::orbit_camera(float yaw, float pitch, float zoom)
+{
+  glm::vec3 offset = cam->eye - cam->target;
+  float distance = glm::length(offset);
+  float theta = std::atan2(offset.x, offset.z) + yaw;
+  float phi = glm::clamp(std::asin(offset.y / distance) + pitch, -1.5f, 1.5f);
+  distance = std::max(distance * zoom, 0.1f);
+  glm::vec3 direction(std::cos(phi) * std::sin(theta), std::sin(phi), std::cos(phi) * std::cos(theta));
+  *cam = PinholeCamera(cam->target + distance * direction, cam->target, cam->fov, cam->aspect);
+  upload_uniforms();
+}
+
+// Room for the indirect dispatch args and one entry per tile of the current resolution
+void Ray_Tracer_App::size_active_tiles()
+{
+  int tiles = ((resolution.x + tile.x - 1) / tile.x) * ((resolution.y + tile.y - 1) / tile.y);
+  glNamedBufferData(bufferID[ACTIVE_TILES], (4 + tiles) * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, bufferID[ACTIVE_TILES]);
+}
+
+// Lists the tiles still above error_threshold and starts an asynchronous readback of their count
+void Ray_Tracer_App::find_active_tiles()
+{
+  const GLuint empty_args[4] = { 0u, 1u, 1u, 0u };
+  glNamedBufferSubData(bufferID[ACTIVE_TILES], 0, sizeof(empty_args), empty_args);
+  glUseProgram(converge_shader.handle);
+  glUniform1f(converge_shader.loc("errorThreshold"), error_threshold);
+  glDispatchCompute((resolution.x + tile.x - 1) / tile.x, (resolution.y + tile.y - 1) / tile.y, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+  if (convergence_fence)
+    return;
+  profiler.begin("readback");
+  glCopyNamedBufferSubData(bufferID[ACTIVE_TILES], bufferID[TILE_READBACK], 0, 0, sizeof(GLuint));
+  profiler.end();
+  convergence_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Picks up the readback once its fence has passed, never waits for it
+void Ray_Tracer_App::poll_convergence()
+{
+  if (!convergence_fence || glClientWaitSync(convergence_fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+    return;
+  glDeleteSync(convergence_fence);
+  convergence_fence = 0;
+  if (*active_tile_count == 0u) {
+    converged = true;
+    console::log("converged to ", error_threshold, " relative error after ", frame_index, " samples");
+  }
+}
+
+// Traces all the samples of the next free tile of the shared frame and copies it straight into place.
+// The flag goes up after the copy, the coordinator only reads tiles whose flag is set.
+void Ray_Tracer_App::render_farm_tile()
+{
+  unsigned t = farm->next_tile.fetch_add(1u);
+  if (t >= farm->tile_count) {
+    app_data.running = false;
+    return; }
+  glm::ivec2 frame(farm->width, farm->height);
+  glm::ivec2 origin = glm::ivec2(t % farm->tiles_x, t / farm->tiles_x) * FARM_TILE;
+  glm::ivec2 size = glm::min(glm::ivec2(FARM_TILE), frame - origin);
+  // the seeds and the camera of the tile's part of the frame, so any worker traces the same samples
+  std::vector<uint32_t> seeds(FARM_TILE * FARM_TILE);
+  for (int y = 0; y < FARM_TILE; ++y)
+    for (int x = 0; x < FARM_TILE; ++x)
+      seeds[y * FARM_TILE + x] = pcg_seed(std::size_t(origin.y + y) * frame.x + origin.x + x);
+  glm::vec2 scale = glm::vec2(FARM_TILE) / glm::vec2(frame);
+  glm::vec3 across = cam->across * scale.x, up = cam->up * scale.y;
+  glm::vec3 corner = cam->corner + cam->across * (float(origin.x) / frame.x) + cam->up * (float(frame.y - origin.y - FARM_TILE) / frame.y);
+  profiler.begin("upload");
+  glNamedBufferSubData(bufferID[SAMPLER_STATE], 0, sizeof(uint32_t) * seeds.size(), seeds.data());
+  profiler.end();
+  profiler.begin("trace");
   glUseProgram(ray_shader.handle);
-  glUniform1i(ray_shader.loc("numShapes"), int(scene.geometry.size()));
-  glUniform1i(ray_shader.loc("numLights"), int(scene.light.size()));
-  glUniform3f(ray_shader.loc("cam.eye"), cam->eye.x, cam->eye.y, cam->eye.z);
-  glUniform3f(ray_shader.loc("cam.across"), cam->across.x, cam->across.y, cam->across.z);
-  glUniform3f(ray_shader.loc("cam.corner"), cam->corner.x, cam->corner.y, cam->corner.z);
-  glUniform3f(ray_shader.loc("cam.up"), cam->up.x, cam->up.y, cam->up.z);
+  glUniform1i(ray_shader.loc("accumulate"), true);
+  glUniform1i(ray_shader.loc("adaptive"), false);
+  glUniform1i(ray_shader.loc("reproject"), false);
+  glUniform3f(ray_shader.loc("cam.across"), across.x, across.y, across.z);
+  glUniform3f(ray_shader.loc("cam.corner"), corner.x, corner.y, corner.z);
+  glUniform3f(ray_shader.loc("cam.up"), up.x, up.y, up.z);
+  glUniform2i(ray_shader.loc("regionOffset"), origin.x, origin.y);
+  glUniform2i(ray_shader.loc("regionSize"), size.x, size.y);
+  for (unsigned sample = 0; sample < max_samples; ++sample) {
+    glUniform1ui(ray_shader.loc("frameIndex"), sample);
+    glUniform1ui(ray_shader.loc("frameSeed"), sample); // the same samples whichever worker takes the tile
+    glDispatchCompute((size.x + tile.x - 1) / tile.x, (size.y + tile.y - 1) / tile.y, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT); }
+  profiler.end();
+  profiler.begin("readback");
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  glPixelStorei(GL_PACK_ROW_LENGTH, frame.x);
+  GLsizei bytes = 4 * sizeof(GLfloat) * ((size.y - 1) * frame.x + size.x);
+  glGetTextureSubImage(render_tex, 0, 0, 0, 0, size.x, size.y, 1, GL_RGBA, GL_FLOAT, bytes,
+                       farm->pixels() + 4 * (origin.y * frame.x + origin.x));
+  glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+  profiler.end();
+  farm->done()[t].store(farm_worker, std::memory_order_release);
+}
+
+// Traces the frame on the cpu and uploads it to render_tex, where present and the readbacks find it
+void Ray_Tracer_App::trace_on_cpu()
+{
+  CPU_Frame frame { &scene, cam->eye, cam->across, cam->corner, cam->up, resolution, MAX_DEPTH, accumulate, frame_index, frame_seed };
+  cpu_tracer.trace(frame);
+  if (app_data.gl)
+    glTextureSubImage2D(render_tex, 0, 0, 0, resolution.x, resolution.y, GL_RGBA, GL_FLOAT, cpu_tracer.image.data());
+}
+
+// Moves to the first batch job from job on whose scene loads, false once none is left. Programs,
+// textures and buffers stay as they are, a different scene goes through reload_scene, which only
+// sends what differs from the last one. A job whose scene doesn't load gets a failed row.
+bool Ray_Tracer_App::start_job(std::size_t job)
+{
+  for (; job < batch.size(); ++job) {
+    job_ticks = SDL_GetTicks();
+    job_upload = 0;
+    if (batch[job].scene == scene_file)
+      break;
+    std::string loaded = scene_file;
+    scene_file = batch[job].scene;
+    if (reload_scene(&job_upload))
+      break;
+    scene_file = loaded;
+    Batch_Job &skipped = batch[job];
+    batch_results << job << ',' << skipped.scene << ',' << skipped.output << ",0,,,,0,failed" << std::endl;
+    console::error("job ", job + 1, '/', batch.size(), ": ", skipped.scene, " doesn't load, skipped");
+    app_data.exit_code = 1; }
+  if (job == batch.size())
+    return false;
+  current_job = job;
+  Batch_Job &j = batch[job];
+  *cam = PinholeCamera(j.eye, j.target, j.fov, camera_aspect(app_data));
+  max_samples = j.samples;
+  upload_uniforms();
+  dirty |= dirty_scene; // a fresh image, not a reprojection of the last job's
+  job_load_ms = SDL_GetTicks() - job_ticks;
+  return true;
+}
+
+// Saves the finished job, adds its row to the results and starts the next one
+void Ray_Tracer_App::finish_job()
+{
+  if (app_data.gl)
+    glFinish();
+  Uint32 now = SDL_GetTicks();
+  Batch_Job &j = batch[current_job];
+  while (captures.size() >= MAX_PENDING_CAPTURES) { // a job's image is never dropped, wait for a free slot
+    poll_captures();
+    std::this_thread::yield(); }
+  save_framebuffer_as_PNG(j.output);
+  Uint32 render_ms = now - job_ticks - job_load_ms;
+  batch_results << current_job << ',' << j.scene << ',' << j.output << ',' << frame_index << ',' << job_load_ms << ','
+                << render_ms << ',' << float(render_ms) / frame_index << ',' << job_upload << ",ok" << std::endl;
+  console::log("job ", current_job + 1, '/', batch.size(), ": ", j.output, " in ", now - job_ticks, " ms");
+  if (!start_job(current_job + 1)) {
+    console::log("batch done in ", now - render_ticks, " ms after ", render_ticks - init_ticks, " ms of setup");
+    app_data.running = false; }
+}
+
+void Ray_Tracer_App::set_render_scale(float scale)
+{
+  scale = glm::clamp(scale, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+  if (scale == render_scale)
+    return;
+  render_scale = scale;
+  resize_render_targets();
+  upload_uniforms();
+  console::log("render resolution: ", resolution.x, 'x', resolution.y, " (", render_scale, "x)");
+}
+
+// Runs after each traced frame. Tracing cost scales with the pixel count, so a scale change by
+// sqrt(target / measured) lands near the budget. Shrinking starts as soon as the budget is exceeded,
+// growing only once the time falls under DYNRES_GROW_BELOW of it; between the two nothing moves.
+void Ray_Tracer_App::adapt_resolution()
+{
+  GLuint previous = dynres.query[(dynres.frame + 1) % 2];
+  if (++dynres.frame < 2)
+    return;
+  GLint available(0);
+  glGetQueryObjectiv(previous, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available)
+    return;
+  GLuint64 elapsed_ns(0);
+  glGetQueryObjectui64v(previous, GL_QUERY_RESULT, &elapsed_ns);
+  float ms = elapsed_ns * 1e-6f;
+  dynres.gpu_ms = (dynres.gpu_ms == 0.0f) ? ms : dynres.gpu_ms + (ms - dynres.gpu_ms) * 0.25f;
+  if (dynres.cooldown > 0) {
+    dynres.cooldown--;
+    return; }
+  if (accumulate && frame_index > 1) // a static image keeps its samples, adapt again on the next change
+    return;
+  float ratio = dynres.target_ms / dynres.gpu_ms;
+  if (ratio >= 1.0f && ratio <= 1.0f / DYNRES_GROW_BELOW)
+    return;
+  float scale = render_scale * glm::clamp(std::sqrt(ratio), 0.5f, 1.25f);
+  scale = glm::clamp(std::round(scale / DYNRES_QUANTUM) * DYNRES_QUANTUM, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+  if (scale == render_scale)
+    return;
+  console::log("dynamic resolution: ", dynres.gpu_ms, " ms GPU for ", dynres.target_ms, " ms budget");
+  set_render_scale(scale);
+  dynres.gpu_ms = 0.0f;
+  dynres.cooldown = DYNRES_SETTLE;
+}
+
+std::vector<Shader*> built_kernels()
+{
+  std::vector<Shader*> kernels = { &ray_shader };
+  if (converge_shader.handle)
+    kernels.push_back(&converge_shader);
+  if (wavefront_shader[0].handle)
+    for (Shader &k : wavefront_shader)
+      kernels.push_back(&k);
+  return kernels;
+}
+
+// Polls the kernels being linked, once all are done they get their uniforms and may be dispatched
+bool Ray_Tracer_App::finish_kernels()
+{
+  std::vector<Shader*> kernels = built_kernels();
+  for (Shader *k : kernels)
+    if (!k->ready())
+      return false;
+  for (Shader *k : kernels)
+    k->finish();
+  kernels_pending = false;
+  upload_uniforms();
+  return true;
+}
+
+void Ray_Tracer_App::upload_uniforms()
+{
+  if (kernels_pending || !ray_shader.handle) // finish_kernels uploads them, the cpu integrator has none
+    return;
+  for (Shader *k : built_kernels()) {
+    bool quiet = (k != &ray_shader); // the other passes only keep the uniforms they read
+    bool baked = !scene_variant.defines.empty(); // scene variants have the counts as constants
+    glUseProgram(k->handle);
+    glUniform1i(k->loc("numShapes", quiet || baked), int(scene.geometry.size()));
+    glUniform1i(k->loc("numLights", quiet || baked), int(scene.light.size()));
+    glUniform1i(k->loc("numBounded", quiet || baked), scene.num_bounded);
+    glUniform2i(k->loc("resolution", quiet), resolution.x, resolution.y);
+    glUniform3f(k->loc("cam.eye", quiet), cam->eye.x, cam->eye.y, cam->eye.z);
+    glUniform3f(k->loc("cam.across", quiet), cam->across.x, cam->across.y, cam->across.z);
+    glUniform3f(k->loc("cam.corner", quiet), cam->corner.x, cam->corner.y, cam->corner.z);
+    glUniform3f(k->loc("cam.up", quiet), cam->up.x, cam->up.y, cam->up.z);
+    if (k != &ray_shader && k != &converge_shader)
+      glUniform1i(k->loc("waveCapacity", quiet), wave_size); }
+  glUseProgram(0);
+  dirty |= dirty_camera;
+}
+
+// Compiles the ray kernel once per candidate tile shape and keeps the one with the lowest
+// GPU time over a few full-frame dispatches. Shapes the driver can't launch are skipped.
+void Ray_Tracer_App::benchmark_tile_sizes()
+{
+  const glm::ivec2 candidates[] = { {8,8}, {16,8}, {8,16}, {16,16}, {32,4}, {32,8}, {64,1}, {4,4} };
+  const int warmup_runs = 1, timed_runs = 4;
+  GLint max_invocations(0), max_size[2] = { 0, 0 };
+  glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &max_size[0]);
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &max_size[1]);
+  GLuint query;
+  glGenQueries(1, &query);
+  GLuint64 best_ns = ~GLuint64(0);
+  glm::ivec2 best = candidates[0];
+  console::log("Compute Tile Benchmark""\n----------------------");
+  std::vector<glm::ivec2> launchable;
+  for (glm::ivec2 candidate : candidates)
+    if (candidate.x * candidate.y <= max_invocations && candidate.x <= max_size[0] && candidate.y <= max_size[1])
+      launchable.push_back(candidate);
+  std::vector<Shader> variants(launchable.size()); // linked side by side, then timed one by one
+  for (std::size_t c = 0; c < launchable.size(); ++c) {
+    tile = launchable[c];
+    compile_kernel(variants[c], STAGE_MEGAKERNEL); }
+  for (std::size_t c = 0; c < launchable.size(); ++c) {
+    variants[c].finish();
+    tile = launchable[c];
+    compile_kernel(ray_shader, STAGE_MEGAKERNEL);
+    upload_uniforms();
+    glUseProgram(ray_shader.handle);
+    GLuint groups_x = (resolution.x + tile.x - 1) / tile.x, groups_y = (resolution.y + tile.y - 1) / tile.y;
+    for (int i = 0; i < warmup_runs; ++i)
+      glDispatchCompute(groups_x, groups_y, 1);
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    for (int i = 0; i < timed_runs; ++i) {
+      glDispatchCompute(groups_x, groups_y, 1);
+      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT); }
+    glEndQuery(GL_TIME_ELAPSED);
+    GLuint64 elapsed_ns(0);
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+    console::log(std::setw(4), tile.x, 'x', std::left, std::setw(4), tile.y, std::right, std::setw(10), elapsed_ns / timed_runs / 1000, " us");
+    if (elapsed_ns < best_ns) {
+      best_ns = elapsed_ns;
+      best = tile; }
+  }
   glUseProgram(0);
+  glDeleteQueries(1, &query);
+  tile = best;
+  std::error_code ec;
+  std::filesystem::create_directories(PROGRAM_CACHE_DIR, ec);
+  std::ofstream(tile_cache_path()) << tile.x << 'x' << tile.y << '\n';
+}
+
+// Rebuilds the kernels in use from the edited source, they replace the running ones only if all link
+void Ray_Tracer_App::reload_kernels()
+{
+  std::vector<Shader*> live = built_kernels();
+  std::vector<int> stages = { STAGE_MEGAKERNEL };
+  if (converge_shader.handle)
+    stages.push_back(STAGE_CONVERGE);
+  if (wavefront_shader[0].handle)
+    for (int stage = STAGE_GENERATE; stage <= STAGE_ARGS; ++stage)
+      stages.push_back(stage);
+  for (Shader *k : live)
+    k->finish();
+  auto retired = std::move(kernel_variants);
+  auto retired_lru = std::move(variant_lru);
+  kernel_variants.clear();
+  variant_lru.clear();
+  std::vector<Shader> fresh(live.size());
+  for (std::size_t i = 0; i < live.size(); ++i)
+    compile_kernel(fresh[i], stages[i]);
+  bool linked = true;
+  for (Shader &k : fresh)
+    linked &= k.finish();
+  if (!linked) {
+    for (auto &variant : kernel_variants)
+      glDeleteProgram(variant.second);
+    kernel_variants = std::move(retired);
+    variant_lru = std::move(retired_lru);
+    console::log("ray-compute.glsl doesn't build, the running kernels stay");
+    return; }
+  for (auto &variant : retired)
+    glDeleteProgram(variant.second);
+  for (std::size_t i = 0; i < live.size(); ++i)
+    live[i]->adopt(fresh[i].handle);
+  kernels_pending = false;
+  upload_uniforms();
+  dirty |= dirty_shader;
+  console::log("reloaded ray-compute.glsl");
+}
+
+void Ray_Tracer_App::reload_render_shader()
+{
+  Shader fresh;
+  fresh.handle = glCreateProgram();
+  fresh.create(GL_VERTEX_SHADER, GL_FRAGMENT_SHADER);
+  fresh.source("shader/window-quad.glsl");
+  fresh.compile();
+  fresh.link(false);
+  if (!fresh.finish()) {
+    glDeleteProgram(fresh.handle);
+    console::log("window-quad.glsl doesn't build, the running shader stays");
+    return; }
+  glDeleteProgram(render_shader.handle);
+  render_shader = fresh;
+  dirty |= dirty_present;
+  console::log("reloaded window-quad.glsl");
+}
+
+// Translates the scene file again and patches only the buffer ranges that changed. The kernels are
+// rebuilt if the scene's variant changed, the menu always, as it shows the heap's values. A file
+// that doesn't load, often one caught halfway through a save, leaves the running scene as it is and
+// returns false. uploaded receives the bytes sent.
+bool Ray_Tracer_App::reload_scene(std::size_t *uploaded)
+{
+  Scene_Interpreter fresh;
+  std::string error;
+  if (!fresh.load(scene_file, error)) {
+    console::log(error, ", the running scene stays");
+    return false; }
+  profiler.begin("upload");
+  std::size_t sent = integrator != cpu ? patch_scene_bufs(fresh, scene) : 0;
+  profiler.end();
+  bool lights_changed = fresh.light.size() != scene.light.size();
+  scene = fresh;
+  for (Scene_Mesh &m : scene.mesh)
+    watcher.watch(m.file);
+  refresh_variant();
+  if (lights_changed && wavefront_shader[0].handle)
+    size_wavefront_queues();
+  upload_uniforms();
+  menu = Terminal_Menu();
   menu.build(&scene);
-  console::log();
-  menu.print(with_header);
+  dirty |= dirty_scene;
+  console::log("reloaded ", scene_file, ", ", sent, " bytes uploaded");
+  if (!app_data.headless)
+    menu.print(with_header);
+  if (uploaded)
+    *uploaded = sent;
+  return true;
 }
 
 void Ray_Tracer_App::on_event(SDL_Event e)
 {
+  if (File_Watcher::event && e.type == File_Watcher::event) {
+    bool scene_changed = false;
+    for (std::string &path : watcher.changed())
+      if (path.find("ray-compute.glsl") != std::string::npos)
+        reload_kernels();
+      else if (path.find("window-quad.glsl") != std::string::npos)
+        reload_render_shader();
+      else
+        scene_changed = true;
+    if (scene_changed)
+      reload_scene();
+    return; }
   if (e.type == SDL_KEYDOWN) {
     switch(e.key.keysym.sym) {
       // Menu Navigation
@@ -84,50 +1044,350 @@ void Ray_Tracer_App::on_event(SDL_Event e)
       // Other
       case SDLK_d: console::print_API_messages(); break;
       case SDLK_s: save_framebuffer_as_PNG();     break;
+      case SDLK_a: accumulate = !accumulate; dirty |= dirty_settings; break;
+      case SDLK_p: show_profiler = !show_profiler; dirty |= dirty_present; break;
+      case SDLK_MINUS:  set_render_scale(render_scale - RENDER_SCALE_STEP); break;
+      case SDLK_EQUALS: set_render_scale(render_scale + RENDER_SCALE_STEP); break;
+      case SDLK_r: dynres.enabled = !dynres.enabled;
+                   dynres.frame = 0;
+                   dynres.gpu_ms = 0.0f;
+                   console::log("dynamic resolution ", dynres.enabled ? "on" : "off"); break;
+      case SDLK_t: temporal = !temporal;
+                   console::log("reprojection ", temporal ? "on" : "off"); break;
+      case SDLK_w: if (integrator == cpu)
+                     break;
+                   integrator = (integrator == megakernel) ? wavefront : megakernel;
+                   if (integrator == wavefront && error_threshold > 0.0f)
+                     console::log("the wavefront integrator samples every pixel, --threshold applies to the megakernel only");
+                   build_wavefront();
+                   dirty |= dirty_settings; break;
+      default: break;
+    }
+  }
+  else if (e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_LMASK))
+    orbit_camera(-0.005f * e.motion.xrel, 0.005f * e.motion.yrel, 1.0f);
+  else if (e.type == SDL_MOUSEWHEEL)
+    orbit_camera(0.0f, 0.0f, std::pow(0.9f, float(e.wheel.y)));
+  else if (e.type == SDL_WINDOWEVENT) {
+    switch (e.window.event) {
+      case SDL_WINDOWEVENT_RESIZED: resize_render_targets();
+                                    *cam = PinholeCamera(cam->eye, cam->target, cam->fov, camera_aspect(app_data));
+                                    upload_uniforms(); break;
+      case SDL_WINDOWEVENT_EXPOSED: dirty |= dirty_present; break;
+      case SDL_WINDOWEVENT_RESTORED:
+      case SDL_WINDOWEVENT_SHOWN:   dirty |= dirty_present; break;
       default: break;
     }
   }
 }
 
+bool Ray_Tracer_App::needs_update()
+{
+  return dirty != clean || kernels_pending || !captures.empty() || frame_stream.in_flight() || (accumulate && frame_index < max_samples && !converged);
+}
+
 void Ray_Tracer_App::on_update()
 {
-  glUseProgram(ray_shader.handle);
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, render_tex);
-  glDispatchCompute(app_data.width, app_data.height, 1);
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+  profiler.next_frame();
+  poll_captures();
+  frame_stream.poll();
+  profiler.begin("upload");
+  flush_heap_edits(scene.heap);
+  profiler.end();
+  if (dirty & dirty_geometry) {
+    refresh_variant();
+    dirty &= ~dirty_geometry; }
+  if (kernels_pending && !finish_kernels()) {
+    const GLfloat placeholder[4] = { 0.1f, 0.1f, 0.1f, 1.0f };
+    glClearTexImage(render_tex, 0, GL_RGBA, GL_FLOAT, placeholder);
+    present();
+    return; }
+  if (farm) {
+    render_farm_tile();
+    return; }
+  // a pure camera move keeps the accumulated image: the next frame reprojects it instead of starting over
+  bool reproject = temporal && accumulate && integrator == megakernel && frame_index > 0
+                && (dirty & ~dirty_present) == dirty_camera;
+  if (dirty & ~dirty_present) {
+    frame_index = 0;
+    converged = false;
+    if (convergence_fence) { // the count belongs to the image being discarded
+      glDeleteSync(convergence_fence);
+      convergence_fence = 0; }
+  }
+  bool trace = (dirty & ~dirty_present) || (accumulate && frame_index < max_samples && !converged);
+  if (trace) {
+    profiler.begin("trace");
+    if (dynres.enabled)
+      glBeginQuery(GL_TIME_ELAPSED, dynres.query[dynres.frame % 2]);
+    if (integrator == wavefront)
+      dispatch_wavefront();
+    else if (integrator == cpu)
+      trace_on_cpu();
+    else {
+      bool adaptive = accumulate && error_threshold > 0.0f && frame_index >= ADAPTIVE_MIN_SAMPLES;
+      if (adaptive) {
+        profiler.begin("tiles");
+        find_active_tiles();
+        profiler.end(); }
+      glUseProgram(ray_shader.handle);
+      glUniform1i(ray_shader.loc("accumulate"), accumulate);
+      glUniform1ui(ray_shader.loc("frameIndex"), frame_index);
+      glUniform1ui(ray_shader.loc("frameSeed"), frame_seed);
+      glUniform1i(ray_shader.loc("adaptive"), adaptive);
+      glUniform1i(ray_shader.loc("reproject"), reproject);
+      if (reproject) {
+        current_history ^= 1u;
+        bind_history();
+        glUniform3f(ray_shader.loc("prevCam.eye"), traced_cam->eye.x, traced_cam->eye.y, traced_cam->eye.z);
+        glUniform3f(ray_shader.loc("prevCam.across"), traced_cam->across.x, traced_cam->across.y, traced_cam->across.z);
+        glUniform3f(ray_shader.loc("prevCam.corner"), traced_cam->corner.x, traced_cam->corner.y, traced_cam->corner.z);
+        glUniform3f(ray_shader.loc("prevCam.up"), traced_cam->up.x, traced_cam->up.y, traced_cam->up.z); }
+      if (adaptive) {
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, bufferID[ACTIVE_TILES]);
+        glDispatchComputeIndirect(0);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0); }
+      else
+        glDispatchCompute((resolution.x + tile.x - 1) / tile.x, (resolution.y + tile.y - 1) / tile.y, 1); }
+    if (dynres.enabled)
+      glEndQuery(GL_TIME_ELAPSED);
+    *traced_cam = *cam;
+    frame_seed++;
+    frame_index = accumulate ? frame_index + 1 : 0;
+    if (integrator != cpu)
+      glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    profiler.end(); }
+  dirty = clean;
+  present();
+  if (trace && dynres.enabled)
+    adapt_resolution();
+  bool was_converged = converged;
+  poll_convergence();
+  if (frame_stream.is_open()) {
+    bool finished = accumulate ? (trace && frame_index == max_samples) || (converged && !was_converged) : trace;
+    if (!capture_converged || finished) {
+      profiler.begin("capture");
+      frame_stream.capture(render_tex, resolution.x, resolution.y);
+      profiler.end(); }
+  }
+  if (!batch.empty() && (frame_index >= max_samples || converged))
+    finish_job();
+  else if (app_data.headless && (frame_index >= max_samples || converged)) {
+    if (app_data.gl)
+      glFinish();
+    Uint32 now = SDL_GetTicks();
+    const char *output_option = option("--output");
+    save_framebuffer_as_PNG(output_option ? output_option : "");
+    console::log("rendered ", frame_index, " samples at ", resolution.x, 'x', resolution.y, " in ", now - render_ticks, " ms, ",
+                 float(now - render_ticks) / frame_index, " ms per sample, after ", render_ticks - init_ticks, " ms of setup");
+    app_data.running = false; }
+}
+
+void Ray_Tracer_App::present()
+{
+  if (app_data.headless) // no window, render_tex is the result
+    return;
+  profiler.begin("present");
   glClear(GL_COLOR_BUFFER_BIT);
   glUseProgram(render_shader.handle);
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_2D, render_tex);
   glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+  if (show_profiler)
+    draw_profiler();
+  profiler.end();
   SDL_GL_SwapWindow(sdl_app_data.p_window);
 }
 
+// One bar per scope from the top left: the average against the frame budget, which is the
+// white tick, and the p99 as a thin line under it. The figures are in the menu's profiler node.
+void Ray_Tracer_App::draw_profiler()
+{
+  const float palette[][3] = { {0.9f,0.3f,0.2f}, {0.2f,0.7f,0.9f}, {0.9f,0.8f,0.2f}, {0.4f,0.9f,0.3f}, {0.8f,0.4f,0.9f} };
+  int full = app_data.width / 3, rows = int(profiler.scope_count());
+  auto bar = [&](float ms, int y, int height) {
+    int width = glm::clamp(int(ms / app_data.ms_per_frame * full), 1, app_data.width - 16);
+    glScissor(8, y, width, height);
+    glClear(GL_COLOR_BUFFER_BIT); };
+  glEnable(GL_SCISSOR_TEST);
+  for (int i = 0; i < rows; ++i) {
+    Profiler_Stats s = profiler.stats(i);
+    const float *c = palette[i % 5];
+    int y = app_data.height - 16 - 12 * i;
+    glClearColor(c[0], c[1], c[2], 1.0f);
+    bar(s.avg_ms, y, 6);
+    bar(s.p99_ms, y - 3, 1); }
+  glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+  glScissor(8 + full, app_data.height - 12 * rows - 8, 1, 12 * rows);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDisable(GL_SCISSOR_TEST);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+// Traces the frame in waves of at most wave_size paths. Every pass after generate is sized on the
+// GPU: STAGE_ARGS turns the length of the queue it is about to consume into indirect dispatch args.
+void Ray_Tracer_App::dispatch_wavefront()
+{
+  auto use = [](int stage) -> Shader& {
+    Shader &k = wavefront_shader[stage - STAGE_GENERATE];
+    glUseProgram(k.handle);
+    return k; };
+  auto barrier = []() { glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT); };
+  auto size_queue = [&](int depth, int queue) {
+    Shader &k = use(STAGE_ARGS);
+    glUniform1i(k.loc("depth"), depth);
+    glUniform1i(k.loc("argsFor"), queue);
+    glDispatchCompute(1, 1, 1);
+    barrier(); };
+  const GLintptr args_offset = 4*sizeof(GLuint);
+  for (int stage : { STAGE_GENERATE, STAGE_SHADE, STAGE_RESOLVE }) {
+    Shader &k = use(stage);
+    glUniform1i(k.loc("accumulate", true), accumulate);
+    glUniform1ui(k.loc("frameIndex", true), frame_index);
+    glUniform1ui(k.loc("frameSeed", true), frame_seed); }
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, bufferID[QSTATE]);
+  int pixels = resolution.x * resolution.y;
+  for (int first = 0; first < pixels; first += wave_size) {
+    int count = std::min(wave_size, pixels - first);
+    glClearNamedBufferSubData(bufferID[QSTATE], GL_R32UI, 0, 4*sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    Shader &generate = use(STAGE_GENERATE);
+    glUniform1i(generate.loc("waveOffset"), first);
+    glUniform1i(generate.loc("waveCount"), count);
+    glDispatchCompute((count + WAVEFRONT_GROUP - 1) / WAVEFRONT_GROUP, 1, 1);
+    barrier();
+    for (int depth = 0; depth < MAX_DEPTH; ++depth) {
+      size_queue(depth, 0);
+      glUniform1i(use(STAGE_EXTEND).loc("depth"), depth);
+      glDispatchComputeIndirect(args_offset);
+      barrier();
+      size_queue(depth, 1);
+      glUniform1i(use(STAGE_SHADE).loc("depth"), depth);
+      glDispatchComputeIndirect(args_offset);
+      barrier();
+      size_queue(depth, 2);
+      use(STAGE_CONNECT);
+      glDispatchComputeIndirect(args_offset);
+      barrier(); }
+  }
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+  use(STAGE_RESOLVE);
+  glDispatchCompute((resolution.x + tile.x - 1) / tile.x, (resolution.y + tile.y - 1) / tile.y, 1);
+}
+
 void Ray_Tracer_App::on_exit()
 {
+  watcher.stop();
+  if (integrator == cpu)
+    cpu_tracer.stop();
+  if (!app_data.gl) { // headless on the cpu, the output was encoded in place
+    png_workers.stop();
+    app_data.exit_code |= int(save_failed);
+    return; }
   glDeleteTextures(1, &render_tex);
+  glDeleteTextures(2, accum_tex);
+  glDeleteTextures(2, gbuffer_tex);
+  glDeleteTextures(1, &moment_tex);
+  glDeleteTextures(1, &sobol_tex);
+  if (convergence_fence)
+    glDeleteSync(convergence_fence);
+  if (active_tile_count)
+    glUnmapNamedBuffer(bufferID[TILE_READBACK]);
+  glDeleteQueries(2, dynres.query);
   glDeleteVertexArrays(1, &render_vao);
+  release_heap_staging();
   glDeleteBuffers(NUM_BUFFERS, bufferID);
+  frame_stream.close();
+  glFinish();
+  while (!captures.empty()) {
+    poll_captures();
+    std::this_thread::yield(); }
+  png_workers.stop();
+  app_data.exit_code |= int(save_failed);
   glDeleteProgram(render_shader.handle);
-  glDeleteProgram(ray_shader.handle);
+  for (auto &variant : kernel_variants)
+    glDeleteProgram(variant.second);
+  console::log('\n', profiler.report());
+  profiler.release();
   console::log("\nAverage FPS: ", 1000.0f/app_data.cma_fdt);
 }
 
-#include <algorithm>
 #include "SDL_image.h"
-void Ray_Tracer_App::save_framebuffer_as_PNG()
+// Runs on a png worker. render_tex rows already run top to bottom, so only the float to 8 bit
+// conversion is left before encoding. Returns whether the file was written.
+bool encode_png(const GLfloat *pixels, int w, int h, const std::string &file)
 {
-  int w = app_data.width, h = app_data.height;
   std::vector<GLubyte> raw_image(4*w*h);
-  glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, raw_image.data());
-  for (int row = 0; row < h/2; ++row)
-    std::swap_ranges(raw_image.begin()+4*w*row, raw_image.begin()+4*w*(row+1), raw_image.begin()+4*w*(h-row-1));
+  for (std::size_t i = 0; i < raw_image.size(); ++i)
+    raw_image[i] = GLubyte(glm::clamp(pixels[i], 0.0f, 1.0f) * 255.0f + 0.5f);
   SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(raw_image.data(), w, h, 32, w*4, SDL_PIXELFORMAT_RGBA32);
   if (!surface) console::log("Warning: failed to create SDL surface. ", SDL_GetError());
-  std::string file = std::string("renders/") + console::date_time() + std::string(".png");
-  if (IMG_SavePNG(surface, file.c_str())<0) console::log("\nWarning: failed to save png. ", IMG_GetError());
+  bool saved = surface && IMG_SavePNG(surface, file.c_str()) >= 0;
+  if (!saved) console::log("\nWarning: failed to save png. ", IMG_GetError());
   SDL_FreeSurface(surface);
+  return saved;
+}
+
+// Only queues the copy of render_tex, poll_captures takes it from there. Without a file name the
+// image goes to renders/ under the date and time.
+void Ray_Tracer_App::save_framebuffer_as_PNG(const std::string &file)
+{
+  std::string path = file.empty() ? std::string("renders/") + console::date_time() + '-' + std::to_string(capture_count++) + ".png" : file;
+  if (!app_data.gl) { // traced on the cpu without a context, the image is already in memory
+    if (!encode_png((const GLfloat*)cpu_tracer.image.data(), resolution.x, resolution.y, path))
+      save_failed = true;
+    return; }
+  if (captures.size() >= MAX_PENDING_CAPTURES) {
+    console::log("\nWarning: ", captures.size(), " saves still in flight, frame not saved");
+    return; }
+  Pending_Capture capture;
+  capture.width = resolution.x;
+  capture.height = resolution.y;
+  GLsizeiptr bytes = 4 * sizeof(GLfloat) * capture.width * capture.height;
+  GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glCreateBuffers(1, &capture.pbo);
+  glNamedBufferStorage(capture.pbo, bytes, nullptr, flags);
+  capture.pixels = (const GLfloat*)glMapNamedBufferRange(capture.pbo, 0, bytes, flags);
+  profiler.begin("readback");
+  glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo);
+  glGetTextureImage(render_tex, 0, GL_RGBA, GL_FLOAT, bytes, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  profiler.end();
+  capture.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  capture.file = path;
+  captures.push_back(capture);
+}
+
+// Hands captures whose copy has landed to the png workers and frees the ones they have encoded.
+// A full queue leaves the capture waiting for the next frame.
+void Ray_Tracer_App::poll_captures()
+{
+  for (auto c = captures.begin(); c != captures.end();) {
+    if (!c->encoded) {
+      if (glClientWaitSync(c->fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        ++c;
+        continue; }
+      auto encoded = std::make_shared<std::atomic<bool>>(false);
+      const GLfloat *pixels = c->pixels;
+      int w = c->width, h = c->height;
+      std::string file = c->file;
+      auto encode = [=]() {
+        if (!encode_png(pixels, w, h, file))
+          save_failed = true;
+        *encoded = true; };
+      if (png_workers.try_submit(encode)) {
+        glDeleteSync(c->fence);
+        c->fence = 0;
+        c->encoded = encoded; }
+      ++c;
+      continue; }
+    if (!*c->encoded) {
+      ++c;
+      continue; }
+    glUnmapNamedBuffer(c->pbo);
+    glDeleteBuffers(1, &c->pbo);
+    c = captures.erase(c);
+  }
 }
 
 
@@ -160,9 +1420,13 @@ void Terminal_Menu::build(Scene_Interpreter *scene)
   context.create_state("geometry", 2, { });
   context.create_state("material", 2, { });
   context.create_state("light",    2, { });
+  MenuID profiler_id = context.create_state("profiler", 0, { });
+  context.states[profiler_id]->report = []() { return profiler.report(); }; // bound to the node, not the name
   std::vector<std::vector<Scene_Object*>*> scene_object_containers = { &scene->geometry, &scene->material, &scene->light };
   int menu_pid = 4;
   for (auto container : scene_object_containers) {
+    bool moves_geometry = (container == &scene->geometry);
+    bool edits_lights = (container == &scene->light);
     for (Scene_Object *o : *container) {
       auto o_id = context.create_state(o->name, menu_pid, {});
       for (Scene_Object_Variable *v : o->variable) {
@@ -170,10 +1434,18 @@ void Terminal_Menu::build(Scene_Interpreter *scene)
         for (int i = 0; i < v->size; i++) {
           auto vc_id = context.create_state(std::to_string(scene->heap[v->index+i]), v_id, {});
           Menu_State *self = context.states[vc_id];
-          this->context.states[vc_id]->modulate = [&, self, v, i, scene](MenuInputID e)
+          this->context.states[vc_id]->modulate = [&, self, v, i, scene, moves_geometry, edits_lights](MenuInputID e)
           {
             scene->heap[v->index+i] += (e==up_input)? +0.05f : (e==down_input)? -0.05f : 0.0f;
-            glNamedBufferSubData(bufferID[HEAP], 0, sizeof(GLfloat)*scene->heap.size(), scene->heap.data());
+            stage_heap_edit(v->index+i, 1);
+            profiler.begin("upload");
+            if (moves_geometry) {
+              patch_index_bufs(*scene);
+              dirty |= dirty_geometry; }
+            else if (edits_lights)
+              patch_light_table(*scene);
+            profiler.end();
+            dirty |= dirty_scene;
             self->name = std::to_string(scene->heap[v->index+i]);
           };
         }
@@ -206,6 +1478,41 @@ void Scene_Interpreter::create_object(std::smatch &m)
   target = o;
 }
 
+// $mesh name file.obj material: the triangles get a bvh of their own, built once here
+void Scene_Interpreter::create_mesh(std::smatch &m)
+{
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::uvec3> faces;
+  target = nullptr;
+  if (!parseOBJ(m[4].str().c_str(), vertices, faces) || faces.empty()) {
+    console::error("mesh ", m[3].str(), " has no triangles, skipped");
+    return; }
+  std::vector<AABB> bounds(faces.size());
+  for (size_t f = 0; f < faces.size(); ++f)
+    for (int k = 0; k < 3; ++k)
+      bounds[f].grow(vertices[faces[f][k]]);
+  std::vector<BVH_Node> nodes;
+  std::vector<int> order;
+  build_BVH(bounds, nodes, order);
+  int vertex_base = mesh_vertices.size(), face_base = mesh_faces.size(), node_base = mesh_bvh.size();
+  for (glm::vec3 &v : vertices)
+    mesh_vertices.push_back(glm::vec4(v, 1.0f));
+  for (int f : order)
+    mesh_faces.push_back(glm::uvec4(vertex_base + faces[f].x, vertex_base + faces[f].y, vertex_base + faces[f].z, 0u));
+  for (BVH_Node n : nodes) {
+    n.offset += (n.count > 0) ? face_base : node_base;
+    mesh_bvh.push_back(n); }
+  AABB object_bounds;
+  object_bounds.grow(nodes[0].lo);
+  object_bounds.grow(nodes[0].hi);
+  Scene_Object *o = new Scene_Object(m);
+  o->material_index = std::stoi(m[5]);
+  o->mesh_index = mesh.size();
+  mesh.push_back({ m[4].str(), node_base, object_bounds });
+  geometry.push_back(o);
+  target = o;
+}
+
 void Scene_Interpreter::create_variable(std::smatch &m)
 {
   unsigned idx, match_size;
@@ -218,15 +1525,22 @@ void Scene_Interpreter::create_variable(std::smatch &m)
 }
 
 #include <fstream>
-void Scene_Interpreter::translate_file(std::string file_name)
+bool Scene_Interpreter::translate_file(std::string file_name)
 {
   std::ifstream ifs(file_name);
+  if (!ifs)
+    return false;
   std::regex o_regex("([#$@]+)([A-z]+)\\s+(\\w+)\\s*([0-9]*)\\s*");
+  std::regex m_regex("(\\$)(mesh)\\s+(\\w+)\\s+(\\S+)\\s+([0-9]+)\\s*");
   std::regex v_regex("(\\w+)\\s+((-?[0-9.]+)\\s+(-?[0-9.]+)\\s+(-?[0-9.]+)\\s+(-?[0-9.]+)|(-?[0-9.]+)\\s+(-?[0-9.]+)\\s+(-?[0-9.]+)|\\s+(-?[0-9.]+)\\s+(-?[0-9.]+)|\\s+(-?[0-9.]+))\\s*");
   std::smatch o_match, v_match;
   for (std::string line; std::getline(ifs, line);) {
-    if (std::regex_match(line, o_match, o_regex)) {
-      this->create_object(o_match);
+    bool is_mesh = std::regex_match(line, o_match, m_regex);
+    if (is_mesh || std::regex_match(line, o_match, o_regex)) {
+      if (is_mesh)
+        this->create_mesh(o_match);
+      else
+        this->create_object(o_match);
       while (std::getline(ifs, line)) {
         if (std::regex_match(line, v_match, v_regex))
           this->create_variable(v_match);
@@ -235,6 +1549,36 @@ void Scene_Interpreter::translate_file(std::string file_name)
       }
     }
   }
+  return true;
+}
+
+// The buffers are compiled from each object's first variable, an object without any is a file cut short
+bool Scene_Interpreter::complete() const
+{
+  for (const std::vector<Scene_Object*> *container : { &geometry, &material, &light })
+    for (const Scene_Object *o : *container)
+      if (o->variable.empty())
+        return false;
+  return !geometry.empty();
+}
+
+#include <stdexcept>
+// Translates file and compiles its buffers. A file that can't be opened, doesn't translate or comes
+// out incomplete returns false with the reason in error.
+bool Scene_Interpreter::load(std::string file, std::string &error)
+{
+  try {
+    if (!translate_file(file)) {
+      error = "can't open " + file;
+      return false; } }
+  catch (const std::logic_error &e) { // std::stof on a value like "." or "-"
+    error = file + " doesn't translate (" + e.what() + ")";
+    return false; }
+  if (!complete()) {
+    error = file + " has no geometry or an object without variables";
+    return false; }
+  regenerate_bufs();
+  return true;
 }
 
 void Scene_Interpreter::regenerate_bufs()
@@ -242,21 +1586,150 @@ void Scene_Interpreter::regenerate_bufs()
   gbuf.clear();
   mbuf.clear();
   lbuf.clear();
-  for (Scene_Object *o : geometry)
-    gbuf.insert(gbuf.end(), { o->subtype, o->variable[0]->index, o->material_index, 0 });
+  std::vector<Scene_Object*> bounded, unbounded;
+  std::vector<AABB> bounds;
+  for (Scene_Object *o : geometry) {
+    if (o->subtype == 1) { // sphere: center, radius
+      int i = o->variable[0]->index;
+      glm::vec3 c(heap[i], heap[i+1], heap[i+2]), r(std::abs(heap[i+3]));
+      bounds.push_back(AABB());
+      bounds.back().grow(c - r);
+      bounds.back().grow(c + r);
+      bounded.push_back(o); }
+    else if (o->subtype == 2) { // mesh: position, scale of its object space bounds
+      int i = o->variable[0]->index;
+      glm::vec3 p(heap[i], heap[i+1], heap[i+2]);
+      float scale = std::max(heap[i+3], 1e-6f);
+      bounds.push_back(AABB());
+      bounds.back().grow(p + scale * mesh[o->mesh_index].bounds.lo);
+      bounds.back().grow(p + scale * mesh[o->mesh_index].bounds.hi);
+      bounded.push_back(o); }
+    else
+      unbounded.push_back(o); }
+  std::vector<int> order;
+  build_BVH(bounds, bvh, order);
+  num_bounded = bounded.size();
+  sphere_table.clear();
+  plane_table.clear();
+  mesh_table.clear();
+  auto push_geometry = [this](Scene_Object *o) {
+    int i = o->variable[0]->index, table_index = 0, root = 0;
+    switch (o->subtype) {
+      case 0: { // plane: point, normal
+        glm::vec3 n = glm::normalize(glm::vec3(heap[i+3], heap[i+4], heap[i+5]));
+        table_index = plane_table.size();
+        plane_table.push_back(glm::vec4(n, glm::dot(n, glm::vec3(heap[i], heap[i+1], heap[i+2])))); break; }
+      case 1: // sphere: center, radius
+        table_index = sphere_table.size();
+        sphere_table.push_back(glm::vec4(heap[i], heap[i+1], heap[i+2], heap[i+3]*heap[i+3])); break;
+      case 2: // mesh: position, scale
+        table_index = mesh_table.size();
+        mesh_table.push_back(glm::vec4(heap[i], heap[i+1], heap[i+2], std::max(heap[i+3], 1e-6f)));
+        root = mesh[o->mesh_index].root; break;
+    }
+    gbuf.insert(gbuf.end(), { o->subtype, table_index, o->material_index, root }); };
+  for (int i : order)
+    push_geometry(bounded[i]);
+  for (Scene_Object *o : unbounded)
+    push_geometry(o);
   for (Scene_Object *o : material)
     mbuf.insert(mbuf.end(), { o->subtype, o->variable[0]->index });
   for (Scene_Object *o : light)
-    lbuf.insert(lbuf.end(), { o->subtype, o->variable[0]->index });
+    lbuf.insert(lbuf.end(), { o->subtype, int(lbuf.size() / 2) });
+  compile_lights();
+}
+
+// Light records hold what shading would otherwise redo per point: unit directions, the spot cosine
+void Scene_Interpreter::compile_lights()
+{
+  light_table.clear();
+  for (Scene_Object *o : light) {
+    int i = o->variable[0]->index;
+    Light_Record r = {};
+    switch (o->subtype) {
+      case 0: // directional: direction, color
+        r.direction = glm::vec4(glm::normalize(glm::vec3(heap[i], heap[i+1], heap[i+2])), 0.0f);
+        r.color = glm::vec4(heap[i+3], heap[i+4], heap[i+5], 1.0f); break;
+      case 1: // point: position, color, intensity
+        r.position = glm::vec4(heap[i], heap[i+1], heap[i+2], 1.0f);
+        r.color = glm::vec4(heap[i+3], heap[i+4], heap[i+5], 1.0f);
+        r.params = glm::vec4(0.0f, heap[i+6], 0.0f, 0.0f); break;
+      case 2: // spot: position, direction, color, intensity, range, angle
+        r.position = glm::vec4(heap[i], heap[i+1], heap[i+2], 1.0f);
+        r.direction = glm::vec4(glm::normalize(glm::vec3(heap[i+3], heap[i+4], heap[i+5])), 0.0f);
+        r.color = glm::vec4(heap[i+6], heap[i+7], heap[i+8], 1.0f);
+        r.params = glm::vec4(std::cos(heap[i+11] * 3.14159f / 360.0f), heap[i+9], heap[i+10], 0.0f); break;
+    }
+    light_table.push_back(r);
+  }
 }
 
 
 
+// Bakes the scene's subtypes and counts into the ray kernels so the compiler drops every branch the
+// scene can't take. Small scenes also get castRay, occluded and getLightSample written out object by
+// object, a fixed sequence of intersection calls in place of the bvh walk and the subtype switches.
+Scene_Variant Scene_Interpreter::variant(bool specialize)
+{
+  Scene_Variant v;
+  if (!specialize)
+    return v;
+  auto mask = [](std::vector<Scene_Object*> &objects) {
+    int m = 0;
+    for (Scene_Object *o : objects)
+      if (o->subtype >= 0)
+        m |= 1 << o->subtype;
+    return std::to_string(m); };
+  v.defines = {
+    { "SCENE_SHAPES", mask(geometry) },
+    { "SCENE_MATERIALS", mask(material) },
+    { "SCENE_LIGHTS", mask(light) },
+    { "NUM_SHAPES", std::to_string(geometry.size()) },
+    { "NUM_BOUNDED", std::to_string(num_bounded) },
+    { "NUM_LIGHTS", std::to_string(light.size()) },
+    { "SCENE_UNROLLED", "0" } };
+  if (geometry.size() > UNROLL_MAX_SHAPES || light.size() > UNROLL_MAX_LIGHTS)
+    return v;
+  v.defines.back().second = "1";
+  const char *shape_type[] = { "Plane(ivec2(", "Sphere(ivec2(", "Mesh(ivec3(" };
+  const char *light_type[] = { "Directional(", "Point(", "Spot(" };
+  std::vector<std::string> shapes;
+  for (std::size_t g = 0; g < gbuf.size(); g += 4) {
+    if (gbuf[g] < 0)
+      continue;
+    std::string shape = shape_type[gbuf[g]] + std::to_string(gbuf[g+1]) + ", " + std::to_string(gbuf[g+2]);
+    if (gbuf[g] == 2)
+      shape += ", " + std::to_string(gbuf[g+3]);
+    shapes.push_back(shape + "))"); }
+  std::ostringstream glsl;
+  glsl << "Isect castRay(Ray ray)\n{\n"
+       << "  float current_min_t = tmax;\n"
+       << "  Isect result = Isect(-1, vec3(0), vec3(0), -1);\n"
+       << "  Isect hit;\n";
+  for (std::string &shape : shapes)
+    glsl << "  hit = intersect(" << shape << ", ray, current_min_t);\n"
+         << "  if (hit.t > 0) { current_min_t = hit.t; result = hit; }\n";
+  glsl << "  return result;\n}\n\n"
+       << "bool occluded(Ray ray, float max_t)\n{\n";
+  for (std::string &shape : shapes)
+    glsl << "  if (occludes(" << shape << ", ray, max_t)) return true;\n";
+  glsl << "  return false;\n}\n\n"
+       << "Light getLightSample(int i, vec3 shadingPoint)\n{\n"
+       << "  switch (i) {\n";
+  for (std::size_t l = 0; l < lbuf.size(); l += 2)
+    if (lbuf[l] >= 0)
+      glsl << "    case " << l / 2 << ": return _sample(" << light_type[lbuf[l]] << lbuf[l+1] << "), shadingPoint);\n";
+  glsl << "    default: break;\n  }\n"
+       << "  return Light(vec3(0), vec3(0), vec3(0));\n}";
+  v.code = glsl.str();
+  return v;
+}
+
 int subtype_string_to_int(std::string s)
 {
   return s == "plane"       ? 0
        : s == "sphere"      ? 1
-       : s == "triangle"    ? 2
+       : s == "mesh"        ? 2
        : s == "diffuse"     ? 0
        : s == "specular"    ? 1
        : s == "reflective"  ? 2
@@ -312,6 +1785,8 @@ MenuID Menu_State::input(MenuInputID e)
   else if (e == enter_input) {
     Menu_State *selected = context->states[c[cursor]];
     if (selected->c.empty()) {
+      if (selected->report)
+        selected->description = selected->report.value()();
       if (selected->description)
         console::log('\r',std::setw(100),"\r\033[F\r",std::setw(100),'\r',selected->description.value());
     }
@@ -328,6 +1803,8 @@ PinholeCamera::PinholeCamera(glm::vec3 eye, glm::vec3 target, float fov, float a
   using namespace glm;
   this->eye = eye;
   this->target = target;
+  this->fov = fov;
+  this->aspect = aspect;
   top = tan(fov * .008726646f);
   right = aspect * top;
   vec3 W = normalize(eye - target);
@@ -0,0 +1,60 @@
+#include "sampler.h"
+
+
+// { s, a, m_1 .. m_s } per dimension after the first, from new-joe-kuo-6.21201
+static const uint32_t joe_kuo[SOBOL_DIMS - 1][8] = {
+  { 1,  0, 1 },
+  { 2,  1, 1, 3 },
+  { 3,  1, 1, 3, 1 },
+  { 3,  2, 1, 1, 1 },
+  { 4,  1, 1, 1, 3, 3 },
+  { 4,  4, 1, 3, 5, 13 },
+  { 5,  2, 1, 1, 5, 5, 17 },
+  { 5,  4, 1, 1, 5, 5, 5 },
+  { 5,  7, 1, 1, 7, 11, 19 },
+  { 5, 11, 1, 1, 5, 1, 1 },
+  { 5, 13, 1, 1, 1, 3, 11 },
+  { 5, 14, 1, 3, 5, 5, 31 },
+  { 6,  1, 1, 3, 3, 9, 7, 49 },
+  { 6, 13, 1, 1, 1, 15, 21, 21 },
+  { 6, 16, 1, 3, 1, 13, 27, 49 },
+};
+
+std::vector<uint32_t> sobol_direction_numbers()
+{
+  std::vector<uint32_t> v(SOBOL_DIMS * SOBOL_BITS);
+  for (int k = 0; k < SOBOL_BITS; ++k)
+    v[k] = 1u << (31 - k); // van der Corput
+  for (int d = 1; d < SOBOL_DIMS; ++d) {
+    uint32_t *dv = &v[d * SOBOL_BITS];
+    uint32_t s = joe_kuo[d-1][0], a = joe_kuo[d-1][1];
+    const uint32_t *m = &joe_kuo[d-1][2];
+    for (uint32_t k = 0; k < SOBOL_BITS; ++k) {
+      if (k < s) {
+        dv[k] = m[k] << (31 - k);
+        continue; }
+      dv[k] = dv[k-s] ^ (dv[k-s] >> s);
+      for (uint32_t j = 1; j < s; ++j)
+        if ((a >> (s - 1 - j)) & 1u)
+          dv[k] ^= dv[k-j];
+    }
+  }
+  return v;
+}
+
+// splitmix32-style finalizer, so neighbouring pixels start far apart in the PCG sequence
+uint32_t pcg_seed(std::size_t i)
+{
+  uint32_t z = uint32_t(i) * 0x9E3779B9u + 0x7F4A7C15u;
+  z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+  z = (z ^ (z >> 13)) * 0xC2B2AE35u;
+  return z ^ (z >> 16);
+}
+
+std::vector<uint32_t> pcg_seeds(std::size_t count)
+{
+  std::vector<uint32_t> seeds(count);
+  for (std::size_t i = 0; i < count; ++i)
+    seeds[i] = pcg_seed(i);
+  return seeds;
+}
@@ -0,0 +1,100 @@
+#include "watcher.h"
+#include <filesystem>
+
+
+Uint32 File_Watcher::event = 0;
+
+static std::string normal_path(const std::string &path)
+{
+  std::filesystem::path p = std::filesystem::path(path).lexically_normal();
+  return (p.has_parent_path() ? p : std::filesystem::path(".") / p).generic_string();
+}
+
+std::vector<std::string> File_Watcher::changed()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<std::string> paths(pending.begin(), pending.end());
+  pending.clear();
+  return paths;
+}
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+bool File_Watcher::start()
+{
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    console::error("inotify_init1 failed, hot reload is off");
+    return false; }
+  event = SDL_RegisterEvents(1);
+  running = true;
+  worker = std::thread(&File_Watcher::run, this);
+  return true;
+}
+
+void File_Watcher::watch(const std::string &path)
+{
+  if (fd < 0)
+    return;
+  std::string file = normal_path(path);
+  std::lock_guard<std::mutex> guard(lock);
+  if (!files.insert(file).second)
+    return;
+  std::string directory = std::filesystem::path(file).parent_path().generic_string();
+  int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0)
+    console::error("can't watch ", directory);
+  else
+    directories[wd] = directory;
+}
+
+// Wakes every 200 ms to notice stop(); a save often raises several events, they make one SDL event
+void File_Watcher::run()
+{
+  alignas(inotify_event) char buffer[4096];
+  pollfd p = { fd, POLLIN, 0 };
+  while (running) {
+    if (poll(&p, 1, 200) <= 0)
+      continue;
+    bool any = false;
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+      for (char *at = buffer; at < buffer + length; at += sizeof(inotify_event) + ((inotify_event*)at)->len) {
+        inotify_event *e = (inotify_event*)at;
+        std::lock_guard<std::mutex> guard(lock);
+        auto directory = directories.find(e->wd);
+        if (e->len == 0 || directory == directories.end())
+          continue;
+        std::string file = directory->second + '/' + e->name;
+        if (files.count(file)) {
+          pending.insert(file);
+          any = true; } }
+    if (any) {
+      SDL_Event e = {};
+      e.type = event;
+      SDL_PushEvent(&e); }
+  }
+}
+
+void File_Watcher::stop()
+{
+  running = false;
+  if (worker.joinable())
+    worker.join();
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
+#else
+bool File_Watcher::start()
+{
+  console::error("hot reload needs inotify (Linux)");
+  return false;
+}
+
+void File_Watcher::watch(const std::string&) {}
+void File_Watcher::run() {}
+void File_Watcher::stop() {}
+#endif
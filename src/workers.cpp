@@ -0,0 +1,50 @@
+#include "workers.h"
+
+
+void Worker_Pool::start(unsigned thread_count, std::size_t queue_capacity)
+{
+  capacity = queue_capacity;
+  stopping = false;
+  for (unsigned i = 0; i < thread_count; ++i)
+    threads.emplace_back(&Worker_Pool::run, this);
+}
+
+bool Worker_Pool::try_submit(std::function<void()> job)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (threads.empty() || jobs.size() >= capacity)
+      return false;
+    jobs.push_back(std::move(job));
+  }
+  wake.notify_one();
+  return true;
+}
+
+void Worker_Pool::run()
+{
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]() { return stopping || !jobs.empty(); });
+      if (jobs.empty())
+        return;
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    job();
+  }
+}
+
+void Worker_Pool::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &t : threads)
+    t.join();
+  threads.clear();
+}